@@ -1,3 +1,3 @@
 #!/bin/bash
 
-gcc -Wall rsc/rascal.c rsc/util.c rsc/object.c rsc/reader.c rsc/printer.c rsc/eval.c rsc/gc.c -lm -o rascal
+gcc -Wall -fcommon rsc/rascal.c rsc/util.c rsc/object.c rsc/reader.c rsc/printer.c rsc/eval.c rsc/gc.c rsc/alloc.c rsc/vm.c rsc/pool.c rsc/array.c rsc/str.c rsc/image.c -lm -lpthread -o rascal
@@ -0,0 +1,193 @@
+#include "alloc.h"
+#include "gc.h"
+
+/*
+Memory allocation. See alloc.h for the layout of the heap.
+ */
+
+static const size_t SIZE_CLASSES[NPOOLS] = { sizeof(cons_t), 16, 24, 32, 48, 64, 96, 128, 192, MAX_CELL };
+
+void init_alloc() {
+  POOLS = malloc(NPOOLS * sizeof(pool_t));
+
+  for (int i = 0; i < NPOOLS; i++) {
+    POOLS[i].cellsize = SIZE_CLASSES[i];
+    POOLS[i].slabs = NULL;
+    POOLS[i].unswept = NULL;
+    POOLS[i].free = NULL;
+    POOLS[i].nslabs = 0;
+    POOLS[i].nfree = 0;
+    POOLS[i].swept = NULL;
+    POOLS[i].swept_free = POOLS[i].swept_tail = NULL;
+    POOLS[i].swept_nfree = 0;
+    POOLS[i].swept_released = 0;
+  }
+
+  LARGE = NULL;
+
+  NURSERY = malloc(NURSERY_SIZE);
+  NURSERY_TOP = NURSERY;
+  NURSERY_END = NURSERY + NURSERY_SIZE;
+}
+
+// Release the whole heap, including the memory owned by the objects in it
+void free_alloc() {
+  large_t * l, * lnext;
+  slab_t * slab, * next;
+
+  for (int i = 0; i < NPOOLS; i++) {
+    for (int swept = 0; swept < 2; swept++) {
+      for (slab = swept ? POOLS[i].slabs : POOLS[i].unswept; slab != NULL; slab = next) {
+        next = slab->next;
+        for (size_t j = 0; j < slab->ncells; j++) {
+          if (slab_cell(slab, j)->type != LOBJ_FREE) lobj_del(slab_cell(slab, j));
+        }
+        free(slab);
+      }
+    }
+  }
+
+  for (l = LARGE; l != NULL; l = lnext) {
+    lnext = l->next;
+    lobj_del(large_obj(l));
+    free(l);
+  }
+
+  free(POOLS);
+  free(NURSERY);
+}
+
+static int pool_for(int type, size_t size) {
+  if (type == LOBJ_CONS) return POOL_CONS;
+
+  for (int i = 1; i < NPOOLS; i++) {
+    if (size <= SIZE_CLASSES[i]) return i;
+  }
+
+  return -1;
+}
+
+// Add a slab to the pool and thread its cells onto the free list in address order
+static void slab_new(pool_t * pool) {
+  slab_t * slab = malloc(SLAB_SIZE);
+  size_t header = (sizeof(slab_t) + 15) & ~(size_t)15;
+
+  slab->cellsize = pool->cellsize;
+  slab->ncells = (SLAB_SIZE - header) / pool->cellsize;
+  slab->cells = (char*)slab + header;
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pool->nslabs++;
+
+  for (size_t i = slab->ncells; i-- > 0;) {
+    free_t * cell = (free_t*)slab_cell(slab, i);
+    cell->type = LOBJ_FREE;
+    cell->next = pool->free;
+    pool->free = LOBJ_CAST(cell);
+  }
+
+  pool->nfree += slab->ncells;
+}
+
+// Allocate an object in the old space. The header is initialized; the body is not.
+lobj_t * lobj_alloc_old(int type, size_t size) {
+  int p = pool_for(type, size);
+  lobj_t * out;
+
+  if (p < 0) {
+    large_t * l = malloc(sizeof(large_t) + size);
+    LASSERT(l != NULL, "Memory Error: could not allocate %zu bytes", size)
+    l->size = size;
+    l->next = LARGE;
+    LARGE = l;
+    out = large_obj(l);
+  } else {
+    pool_t * pool = &POOLS[p];
+    if (pool->free == NULL) sweep_adopt(pool);
+    while (pool->free == NULL && sweep_slab(pool)) sweep_adopt(pool);
+    if (pool->free == NULL) slab_new(pool);
+
+    out = pool->free;
+    pool->free = ((free_t*)out)->next;
+    pool->nfree--;
+  }
+
+  out->type = type;
+  out->tag = GC_WHITE;
+  ALLOCATIONS++;
+
+  return out;
+}
+
+// Allocate an object of the given type and size. The header is initialized; the body is not.
+lobj_t * lobj_alloc(int type, size_t size) {
+  lobj_t * out;
+
+  // Every live object the caller holds is on the shadow stack, so any collection is safe here
+  if (GC_STATE == GC_IDLE && ALLOCATIONS > GC_THRESHOLD) {
+    if (GC_PAUSE_US > 0) gc_start(); else gc();
+  } else if (GC_STATE != GC_IDLE && ++GC_STEP_COUNT >= GC_STEP_INTERVAL) {
+    gc_step();
+  }
+
+  if (nursery_type(type) && size <= MAX_CELL) {
+    size = (size + 7) & ~(size_t)7;
+
+    if (NURSERY_TOP + size > NURSERY_END) minor_gc();
+
+    if (NURSERY_TOP + size <= NURSERY_END) {
+      out = LOBJ_CAST(NURSERY_TOP);
+      NURSERY_TOP += size;
+      out->type = type;
+      out->tag = GC_WHITE;
+      return out;
+    }
+  }
+
+  out = lobj_alloc_old(type, size);
+
+  // Large frames and vectors skip the nursery but are initialized with pointers to young objects
+  if (nursery_type(type)) remember(out);
+
+  return out;
+}
+
+size_t lobj_size(lobj_t * obj) {
+  switch (obj->type) {
+  case LOBJ_CONS:  return sizeof(cons_t);
+  case LOBJ_SYM:   return sizeof(sym_t);
+  case LOBJ_STR:   return sizeof(str_t);
+  case LOBJ_STRBUF: return sizeof(strbuf_t);
+  case LOBJ_NUM:   return sizeof(num_t);
+  case LOBJ_ERR:   return sizeof(err_t);
+  case LOBJ_PRIM:  return sizeof(prim_t);
+  case LOBJ_PROC:  return sizeof(lambda_t);
+  case LOBJ_FRAME: return sizeof(frame_t) + ((frame_t*)obj)->size * sizeof(lobj_t*);
+  case LOBJ_LREF:  return sizeof(lref_t);
+  case LOBJ_CODE:  return sizeof(code_t) + ((code_t*)obj)->nconsts * sizeof(lobj_t*);
+  case LOBJ_VEC:   return sizeof(vec_t) + ((vec_t*)obj)->len * sizeof(lobj_t*);
+  case LOBJ_ARR:   return sizeof(arr_t) + ((arr_t*)obj)->len * sizeof(int64_t);
+  case LOBJ_FWD:   return obj->tag;
+  default:         return sizeof(free_t);
+  }
+}
+
+// Call fn on every live object in the heap
+void heap_walk(void (*fn)(lobj_t *)) {
+  // Unswept slabs may still hold garbage
+  sweep_finish();
+
+  for (int p = 0; p < NPOOLS; p++) {
+    for (slab_t * slab = POOLS[p].slabs; slab; slab = slab->next) {
+      for (size_t i = 0; i < slab->ncells; i++) {
+        if (slab_cell(slab, i)->type != LOBJ_FREE) fn(slab_cell(slab, i));
+      }
+    }
+  }
+
+  for (large_t * l = LARGE; l; l = l->next) fn(large_obj(l));
+
+  for (char * p = NURSERY; p < NURSERY_TOP; p += (lobj_size(LOBJ_CAST(p)) + 7) & ~(size_t)7) {
+    if (LOBJ_CAST(p)->type != LOBJ_FWD) fn(LOBJ_CAST(p));
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef alloc_h
+#define alloc_h
+#include "rascal.h"
+#include "object.h"
+
+/*
+
+Slab allocator
+
+Objects are carved out of slabs of SLAB_SIZE bytes, each of which holds cells of a
+single size. Cons cells have a pool of their own; every other type shares a pool with
+objects of the same size class. Free cells are tagged LOBJ_FREE and threaded onto
+their pool's free list. Sweeping is lazy: when a collection finishes marking, every slab
+moves to its pool's unswept list and is swept back onto slabs by a background thread, or
+by an allocation that finds the free list empty with nothing swept to take. Objects too big
+for the largest size class are malloced with a large_t header and kept on LARGE.
+
+Small objects of the types listed in nursery_type are first bump-allocated in the
+nursery (see rascal.h) and only reach the slabs if they survive a minor collection.
+Symbols, strings and errors own malloced memory and primitives live for the life of
+the interpreter, so they are allocated directly in the old space.
+
+*/
+
+#define SLAB_SIZE (64 * 1024)
+#define NPOOLS 10
+#define POOL_CONS 0
+#define MAX_CELL 256
+
+typedef struct _free_t {
+  LOBJ_HEAD
+  lobj_t * next;
+} free_t;
+
+typedef struct _slab_t {
+  struct _slab_t * next;
+  size_t ncells;
+  size_t cellsize;
+  char * cells;
+} slab_t;
+
+typedef struct _pool_t {
+  size_t cellsize;
+  slab_t * slabs;
+  slab_t * unswept;
+  lobj_t * free;
+  size_t nslabs;
+  size_t nfree;
+  // Swept by the background sweeper and waiting to be taken back by sweep_adopt
+  slab_t * swept;
+  lobj_t * swept_free;
+  lobj_t * swept_tail;
+  size_t swept_nfree;
+  size_t swept_released;
+} pool_t;
+
+// Nursery object that has been copied to the old space. Its size is kept in the tag.
+typedef struct _fwd_t {
+  LOBJ_HEAD
+  lobj_t * to;
+} fwd_t;
+
+typedef struct _large_t {
+  struct _large_t * next;
+  size_t size;
+} large_t;
+
+#define POOLS (RASCAL->pools)
+#define LARGE (RASCAL->large)
+
+#define nursery_type(t)    ((t) == LOBJ_CONS || (t) == LOBJ_NUM || (t) == LOBJ_PROC || \
+                            (t) == LOBJ_FRAME || (t) == LOBJ_LREF || (t) == LOBJ_VEC)
+#define slab_cell(slab, i) ((lobj_t*)((slab)->cells + (i) * (slab)->cellsize))
+#define large_obj(l)       ((lobj_t*)((l) + 1))
+
+/* Forward declarations */
+void init_alloc();
+void free_alloc();
+int sweep_slab(pool_t *);
+void sweep_adopt(pool_t *);
+void sweep_finish();
+void gc_start();
+void gc_step();
+void gc();
+void minor_gc();
+lobj_t * lobj_alloc(int, size_t);
+lobj_t * lobj_alloc_old(int, size_t);
+size_t lobj_size(lobj_t *);
+void heap_walk(void (*)(lobj_t *));
+
+#endif
@@ -0,0 +1,228 @@
+#include "array.h"
+#include "util.h"
+
+
+/*
+Kernels. Each is written with GCC vector types of four 64-bit lanes and a scalar loop
+for the elements left over. On x86-64 every kernel is compiled twice, for AVX2 and for
+the baseline (SSE2, two instructions to a vector), and the loader picks the version the
+processor supports; elsewhere the compiler lowers the vectors to whatever it has.
+Addition, subtraction and multiplication are done on unsigned lanes, so they wrap
+around instead of overflowing; so does division, where INT64_MIN / -1 is INT64_MIN.
+*/
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+#define LANES 4
+typedef int64_t i64x4 __attribute__((vector_size(LANES * 8), aligned(8), may_alias));
+typedef uint64_t u64x4 __attribute__((vector_size(LANES * 8), aligned(8), may_alias));
+
+static KERNEL int64_t kernel_sum(const int64_t * x, long n) {
+  u64x4 acc = { 0 };
+  uint64_t out;
+  long i = 0;
+
+  for (; i + LANES <= n; i += LANES) acc += *(const u64x4*)(x + i);
+  out = acc[0] + acc[1] + acc[2] + acc[3];
+  for (; i < n; i++) out += x[i];
+
+  return (int64_t)out;
+}
+
+static KERNEL int64_t kernel_dot(const int64_t * x, const int64_t * y, long n) {
+  u64x4 acc = { 0 };
+  uint64_t out;
+  long i = 0;
+
+  for (; i + LANES <= n; i += LANES) acc += *(const u64x4*)(x + i) * *(const u64x4*)(y + i);
+  out = acc[0] + acc[1] + acc[2] + acc[3];
+  for (; i < n; i++) out += (uint64_t)x[i] * (uint64_t)y[i];
+
+  return (int64_t)out;
+}
+
+// The least (CMP <) or greatest (CMP >) of the n > 0 elements of x
+#define EXTREMUM(name, CMP)                                                       \
+  static KERNEL int64_t name(const int64_t * x, long n) {                        \
+    int64_t out = x[0];                                                           \
+    long i = 0;                                                                   \
+    if (n >= LANES) {                                                             \
+      i64x4 acc = *(const i64x4*)x, v, take;                                      \
+      for (i = LANES; i + LANES <= n; i += LANES) {                               \
+        v = *(const i64x4*)(x + i);                                               \
+        take = v CMP acc;                                                         \
+        acc = (v & take) | (acc & ~take);                                         \
+      }                                                                           \
+      for (int j = 0; j < LANES; j++) if (acc[j] CMP out) out = acc[j];           \
+    }                                                                             \
+    for (; i < n; i++) if (x[i] CMP out) out = x[i];                              \
+    return out;                                                                   \
+  }
+
+EXTREMUM(kernel_min, <)
+EXTREMUM(kernel_max, >)
+
+// out = a OP b, where b is NULL to use k for every element. Comparisons give -1 or 0
+// in each lane, so MASK is 1 for them to leave 1 or 0, and -1 (every bit) otherwise.
+#define ELEMENTWISE(name, V, S, OP, MASK)                                             \
+  static KERNEL void name(int64_t * out, const int64_t * a, const int64_t * b, int64_t k, long n) { \
+    long i = 0;                                                                       \
+    if (b == NULL) {                                                                  \
+      V y = (V){ 0 } + (S)k;                                                          \
+      for (; i + LANES <= n; i += LANES)                                              \
+        *(V*)(out + i) = (V)((*(const V*)(a + i) OP y) & MASK);                       \
+      for (; i < n; i++) out[i] = (int64_t)(((S)a[i] OP (S)k) & MASK);               \
+    } else {                                                                          \
+      for (; i + LANES <= n; i += LANES)                                              \
+        *(V*)(out + i) = (V)((*(const V*)(a + i) OP *(const V*)(b + i)) & MASK);      \
+      for (; i < n; i++) out[i] = (int64_t)(((S)a[i] OP (S)b[i]) & MASK);            \
+    }                                                                                 \
+  }
+
+ELEMENTWISE(kernel_add, u64x4, uint64_t, +, -1)
+ELEMENTWISE(kernel_sub, u64x4, uint64_t, -, -1)
+ELEMENTWISE(kernel_mul, u64x4, uint64_t, *, -1)
+ELEMENTWISE(kernel_lt, i64x4, int64_t, <, 1)
+ELEMENTWISE(kernel_gt, i64x4, int64_t, >, 1)
+ELEMENTWISE(kernel_eq, i64x4, int64_t, ==, 1)
+
+// There is no vector division on x86, so this one is scalar. Dividing by -1 negates,
+// which wraps for INT64_MIN where the division instruction would trap.
+static void kernel_div(int64_t * out, const int64_t * a, const int64_t * b, int64_t k, long n) {
+  int64_t d;
+
+  for (long i = 0; i < n; i++) {
+    d = b == NULL ? k : b[i];
+    out[i] = d == -1 ? (int64_t)(0 - (uint64_t)a[i]) : a[i] / d;
+  }
+}
+
+typedef void (*kernel_t)(int64_t *, const int64_t *, const int64_t *, int64_t, long);
+
+
+/* Primitives */
+static long arr_index(lobj_t * arr, lobj_t * i) {
+  long n = tonum(i);
+  LASSERT(n >= 0 && n < toarr(arr)->len, "Index Error: %li out of range for array of length %li", n, toarr(arr)->len)
+
+  return n;
+}
+
+lobj_t * prim_make_arr(lobj_t * args[2], lobj_t ** env) {
+  long fill = tonum(args[1]);
+  arr_t * out = mk_arr(tonum(args[0]));
+
+  for (long i = 0; i < out->len; i++) out->items[i] = fill;
+
+  return LOBJ_CAST(out);
+}
+
+// The integers from start up to (not including) end
+lobj_t * prim_arr_range(lobj_t * args[2], lobj_t ** env) {
+  long start = tonum(args[0]), end = tonum(args[1]);
+  arr_t * out = mk_arr(end > start ? end - start : 0);
+
+  for (long i = 0; i < out->len; i++) out->items[i] = start + i;
+
+  return LOBJ_CAST(out);
+}
+
+lobj_t * prim_arr_ref(lobj_t * args[2], lobj_t ** env) {
+  return new_num(toarr(args[0])->items[arr_index(args[0], args[1])]);
+}
+
+lobj_t * prim_arr_set(lobj_t * args[3], lobj_t ** env) {
+  toarr(args[0])->items[arr_index(args[0], args[1])] = tonum(args[2]);
+  return args[2];
+}
+
+lobj_t * prim_arr_len(lobj_t * args[1], lobj_t ** env) {
+  return new_num(toarr(args[0])->len);
+}
+
+lobj_t * prim_list_to_arr(lobj_t * args[1], lobj_t ** env) {
+  lobj_t * xs = args[0];
+  arr_t * out;
+
+  preserve(&xs);
+  out = mk_arr(list_len(xs));
+  release(1);
+
+  for (long i = 0; i < out->len; i++, xs = cdr(xs)) out->items[i] = tonum(car(xs));
+
+  return LOBJ_CAST(out);
+}
+
+lobj_t * prim_arr_to_list(lobj_t * args[1], lobj_t ** env) {
+  lobj_t * arr = args[0], * out = NIL, * x = NIL;
+  preserve(&arr, &out, &x);
+
+  for (long i = toarr(arr)->len; i-- > 0;) {
+    x = new_num(toarr(arr)->items[i]);
+    out = new_cons(x, out);
+  }
+
+  release(3);
+  return out;
+}
+
+lobj_t * prim_arr_sum(lobj_t * args[1], lobj_t ** env) {
+  return new_num(kernel_sum(toarr(args[0])->items, toarr(args[0])->len));
+}
+
+lobj_t * prim_arr_min(lobj_t * args[1], lobj_t ** env) {
+  LASSERT(toarr(args[0])->len > 0, "Value Error: min of an empty array")
+  return new_num(kernel_min(toarr(args[0])->items, toarr(args[0])->len));
+}
+
+lobj_t * prim_arr_max(lobj_t * args[1], lobj_t ** env) {
+  LASSERT(toarr(args[0])->len > 0, "Value Error: max of an empty array")
+  return new_num(kernel_max(toarr(args[0])->items, toarr(args[0])->len));
+}
+
+lobj_t * prim_arr_dot(lobj_t * args[2], lobj_t ** env) {
+  arr_t * x = toarr(args[0]), * y = toarr(args[1]);
+  LASSERT(x->len == y->len, "Value Error: arrays of length %li and %li", x->len, y->len)
+
+  return new_num(kernel_dot(x->items, y->items, x->len));
+}
+
+// Apply kernel to the array args[0] and the array or number args[1]
+static lobj_t * elementwise(lobj_t * args[2], kernel_t kernel) {
+  lobj_t * a = args[0], * b = args[1];
+  long n = toarr(a)->len;
+  arr_t * out;
+
+  if (!isnum(b)) LASSERT(toarr(b)->len == n, "Value Error: arrays of length %li and %li", n, toarr(b)->len)
+
+  // Arrays are never moved, so a and b only need to be kept alive
+  preserve(&a, &b);
+  out = mk_arr(n);
+  release(2);
+
+  kernel(out->items, toarr(a)->items, isnum(b) ? NULL : toarr(b)->items, isnum(b) ? tonum(b) : 0, n);
+  return LOBJ_CAST(out);
+}
+
+lobj_t * prim_arr_add(lobj_t * args[2], lobj_t ** env) { return elementwise(args, kernel_add); }
+lobj_t * prim_arr_sub(lobj_t * args[2], lobj_t ** env) { return elementwise(args, kernel_sub); }
+lobj_t * prim_arr_mul(lobj_t * args[2], lobj_t ** env) { return elementwise(args, kernel_mul); }
+lobj_t * prim_arr_lt(lobj_t * args[2], lobj_t ** env) { return elementwise(args, kernel_lt); }
+lobj_t * prim_arr_gt(lobj_t * args[2], lobj_t ** env) { return elementwise(args, kernel_gt); }
+lobj_t * prim_arr_eq(lobj_t * args[2], lobj_t ** env) { return elementwise(args, kernel_eq); }
+
+lobj_t * prim_arr_div(lobj_t * args[2], lobj_t ** env) {
+  lobj_t * b = args[1];
+
+  if (isnum(b)) {
+    LASSERT(tonum(b) != 0, "Divide by Zero Error.")
+  } else {
+    for (long i = 0; i < toarr(b)->len; i++) LASSERT(toarr(b)->items[i] != 0, "Divide by Zero Error.")
+  }
+
+  return elementwise(args, kernel_div);
+}
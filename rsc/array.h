@@ -0,0 +1,38 @@
+#ifndef array_h
+#define array_h
+#include "rascal.h"
+#include "object.h"
+
+/*
+
+Typed arrays
+
+An arr_t holds 64-bit integers unboxed and contiguous, so a numeric loop over one costs
+no allocation or type check per element. The bulk operations (sum, min, max, dot, the
+elementwise arithmetic and the comparisons, which give an array of 0s and 1s) run as
+kernels over several elements at a time; see array.c. Elementwise operations take two
+arrays of the same length, or an array and a number, which is used for every element.
+
+*/
+
+/* Forward declarations */
+lobj_t * prim_make_arr(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_range(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_ref(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_set(lobj_t * args[3], lobj_t **);
+lobj_t * prim_arr_len(lobj_t * args[1], lobj_t **);
+lobj_t * prim_list_to_arr(lobj_t * args[1], lobj_t **);
+lobj_t * prim_arr_to_list(lobj_t * args[1], lobj_t **);
+lobj_t * prim_arr_sum(lobj_t * args[1], lobj_t **);
+lobj_t * prim_arr_min(lobj_t * args[1], lobj_t **);
+lobj_t * prim_arr_max(lobj_t * args[1], lobj_t **);
+lobj_t * prim_arr_dot(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_add(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_sub(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_mul(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_div(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_lt(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_gt(lobj_t * args[2], lobj_t **);
+lobj_t * prim_arr_eq(lobj_t * args[2], lobj_t **);
+
+#endif
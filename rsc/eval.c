@@ -1,61 +1,235 @@
 #include "eval.h"
+#include "vm.h"
 
 
-lobj_t * bind_args(lambda_t * fun, lobj_t * args) {
-  lobj_t * formals = fun->formals;
-  lobj_t * bound_env = *(fun->env);
-
-  // Bind formals in the environment of the procedure body
-  for (; !isnil(args); args = cdr(args)) {
-    bound_env = intern(car(formals), &bound_env, car(args));
-    formals = cdr(formals);
+/*
+Resolution pass. Run when a lambda is created: returns a copy of expr in which every
+reference to a variable bound by an enclosing lambda is replaced by an lref giving its
+frame depth and slot. scope is a list of formals lists, innermost first. Quoted data is
+left alone apart from unquoted subexpressions, and nested lambdas are resolved in the
+same pass and rewritten to use CLOSURE.
+ */
+static int scope_find(lobj_t * sym, lobj_t * scope, int * depth, int * slot) {
+  for (*depth = 0; !isnil(scope); scope = cdr(scope), (*depth)++) {
+    *slot = 0;
+    for (lobj_t * f = car(scope); iscons(f); f = cdr(f), (*slot)++) {
+      if (car(f) == sym) return 1;
+    }
   }
 
-  LASSERT(isnil(formals), "arity error")
-  return bound_env;
+  return 0;
+}
+
+static lobj_t * resolve_list(lobj_t * xs, lobj_t * scope) {
+  if (!iscons(xs)) return resolve(xs, scope);
+
+  lobj_t * head = NIL, * out;
+  preserve(&xs, &scope, &head);
+  head = resolve(car(xs), scope);
+  out = new_cons(head, resolve_list(cdr(xs), scope));
+  release(3);
+
+  return out;
+}
+
+static lobj_t * resolve_quoted(lobj_t * x, lobj_t * scope) {
+  if (!iscons(x)) return x;
+
+  if (issym(car(x)) && symnameq(car(x), "unquote")) return resolve_list(x, scope);
+
+  lobj_t * head = NIL, * tail;
+  preserve(&x, &scope, &head);
+  head = resolve_quoted(car(x), scope);
+  tail = resolve_quoted(cdr(x), scope);
+  release(3);
+
+  return head == car(x) && tail == cdr(x) ? x : new_cons(head, tail);
 }
 
+lobj_t * resolve(lobj_t * expr, lobj_t * scope) {
+  int depth, slot;
+
+  if (issym(expr)) {
+    return scope_find(expr, scope, &depth, &slot) ? new_lref(expr, depth, slot) : expr;
+  }
+
+  if (!iscons(expr) || car(expr) == CONSTANT) return expr;
+
+  // Special forms are recognised by their global binding unless the name is shadowed
+  lobj_t * head = car(expr), * fun = NIL, * out = NIL;
+  if (issym(head) && !scope_find(head, scope, &depth, &slot)) fun = lookup(head, &TOPENV);
+
+  proc_t form = isprim(fun) ? toprim(fun)->body : NULL;
+
+  preserve(&expr, &scope, &out);
+
+  if (form == form_quote && iscons(cdr(expr))) {
+    out = resolve_quoted(car(cdr(expr)), scope);
+    out = new_cons(out, cdr(cdr(expr)));
+    out = new_cons(car(expr), out);
+  } else if (form == form_fn && iscons(cdr(expr)) && iscons(cdr(cdr(expr)))) {
+    // out holds the scope of the body, then the body itself
+    out = new_cons(car(cdr(expr)), scope);
+    out = resolve(car(cdr(cdr(expr))), out);
+    out = new_cons(out, cdr(cdr(cdr(expr))));
+    out = new_cons(car(cdr(expr)), out);
+    out = new_cons(CLOSURE, out);
+  } else if (form == form_def && iscons(cdr(expr))) {
+    out = resolve_list(cdr(cdr(expr)), scope);
+    out = new_cons(car(cdr(expr)), out);
+    out = new_cons(car(expr), out);
+  } else {
+    out = resolve_list(expr, scope);
+  }
+
+  release(3);
+  return out;
+}
 
 
+/*
+Evaluation runs in a loop: the tail positions of if and do replace the expression being
+evaluated and go round again instead of recursing. Lambda bodies run in the VM, which
+handles their tail calls itself, so a loop written as tail recursion runs in constant C
+stack however it is split between the two.
+ */
 lobj_t * lobj_eval(lobj_t * v, lobj_t ** env) {
-  lobj_t * out = v;
+  lobj_t * head = NIL;
+  proc_t form;
+  preserve(&v, &head);
 
- switch (out->type) {
-  case LOBJ_NUM:
-  case LOBJ_ERR:
-  case LOBJ_PROC:
-  case LOBJ_PRIM:
-  case LOBJ_STR:
+ tailcall:
+  switch (lobj_type(v)) {
+  case LOBJ_SYM:
+    v = lookup(v, env);
     break;
-  case LOBJ_SYM:{
-    out = lookup(out, env);
+  case LOBJ_LREF:{
+    lref_t * ref = tolref(v);
+    v = *frame_slot(*env, ref->depth, ref->slot);
     break;
   }
   case LOBJ_CONS:{
-    // Call recursively on car and cdr.
-     lobj_t * head = lobj_eval(car(out), env);
-     lobj_t * tail = cdr(out);
+    head = lobj_eval(car(v), env);
+    form = isprim(head) ? toprim(head)->body : NULL;
 
-     out = (isproc(head) || isprim(head)) ?
-           apply(head, env, tail) :
-           new_cons(head, lobj_eval(tail, env));
-     break;
+    if (form == form_if && list_len(cdr(v)) == 3) {
+      v = isnil(lobj_eval(car(cdr(v)), env)) ? car(cdr(cdr(cdr(v)))) : car(cdr(cdr(v)));
+      goto tailcall;
+    }
+
+    if (form == form_do && list_len(cdr(v)) == 1 && iscons(car(cdr(v)))) {
+      for (v = car(cdr(v)); iscons(cdr(v)); v = cdr(v)) lobj_eval(car(v), env);
+      v = car(v);
+      goto tailcall;
+    }
+
+    if (isproc(head) || isprim(head)) {
+      v = apply(head, env, cdr(v));
+    } else {
+      v = lobj_eval(cdr(v), env);
+      v = new_cons(head, v);
+    }
+    break;
+  }
+  default:
+    break;
   }
- }  
 
- return out;
+  release(2);
+  return v;
+}
+
+/*
+Expansion pass. Run once on each top-level form as it is read (see load_lisp_file and
+the REPL). quote copies its argument through lobj_expand every time it is evaluated;
+where that would change nothing, the quote form is rewritten in place to use CONSTANT,
+so evaluating it costs nothing. Quoted data containing unquote is still built by
+form_quote, but the expressions inside the unquotes are expanded in turn. Special forms
+are recognised as in resolve, so a local named quote is left alone.
+ */
+
+// Formals of the lambdas enclosing an expression, innermost first
+typedef struct _xscope_t {
+  lobj_t * formals;
+  struct _xscope_t * up;
+} xscope_t;
+
+// Quoted data can be a constant unless quote would expand something inside it
+int quotable(lobj_t * x) {
+  for (; iscons(x); x = cdr(x)) {
+    if (!quotable(car(x))) return 0;
+  }
+
+  return !issym(x) || !ismacro(lookup(x, &TOPENV));
+}
+
+static int xscope_find(lobj_t * sym, xscope_t * scope) {
+  for (; scope != NULL; scope = scope->up) {
+    for (lobj_t * f = scope->formals; iscons(f); f = cdr(f)) {
+      if (car(f) == sym) return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void expand_expr(lobj_t *, xscope_t *);
+
+static void expand_unquoted(lobj_t * x, xscope_t * scope) {
+  for (; iscons(x); x = cdr(x)) {
+    lobj_t * head = car(x), * fun = issym(head) ? lookup(head, &TOPENV) : NIL;
+
+    if (isprim(fun) && toprim(fun)->body == form_unquote) {
+      for (x = cdr(x); iscons(x); x = cdr(x)) expand_expr(car(x), scope);
+      return;
+    }
+
+    expand_unquoted(head, scope);
+  }
+}
+
+// Nothing here allocates, so the forms can be rewritten without registering them
+static void expand_expr(lobj_t * x, xscope_t * scope) {
+  if (!iscons(x)) return;
+
+  lobj_t * head = car(x), * fun = NIL;
+  if (issym(head) && !xscope_find(head, scope)) fun = lookup(head, &TOPENV);
+
+  proc_t form = isprim(fun) ? toprim(fun)->body : NULL;
+
+  if (form == form_quote && iscons(cdr(x))) {
+    if (quotable(car(cdr(x)))) {
+      write_barrier(x, CONSTANT);
+      tocons(x)->_car = CONSTANT;
+    } else {
+      expand_unquoted(car(cdr(x)), scope);
+    }
+  } else if (form == form_fn && iscons(cdr(x)) && iscons(cdr(cdr(x)))) {
+    xscope_t inner = { car(cdr(x)), scope };
+    expand_expr(car(cdr(cdr(x))), &inner);
+  } else {
+    for (; iscons(x); x = cdr(x)) expand_expr(car(x), scope);
+  }
+}
+
+lobj_t * expand_quotes(lobj_t * x) {
+  expand_expr(x, NULL);
+  return x;
 }
 
 
 lobj_t * lobj_expand(lobj_t * v, lobj_t ** env) {
   lobj_t * out = v, * binding;
 
- switch (out->type) {
+ switch (lobj_type(out)) {
   case LOBJ_NUM:
+  case LOBJ_CONST:
   case LOBJ_ERR:
   case LOBJ_PROC:
   case LOBJ_PRIM:
   case LOBJ_STR:
+  case LOBJ_FRAME:
+  case LOBJ_LREF:
     break;
   // Symbols should only be substituted if they represent macros
   case LOBJ_SYM:{
@@ -65,12 +239,18 @@ lobj_t * lobj_expand(lobj_t * v, lobj_t ** env) {
   }
   case LOBJ_CONS:{
     // Call recursively on car and cdr.
-     lobj_t * head = lobj_expand(car(out), env);
-     lobj_t * tail = lobj_expand(cdr(out), env);
+     lobj_t * head = NIL, * tail;
+     preserve(&out, &head);
+     head = lobj_expand(car(out), env);
+     tail = lobj_expand(cdr(out), env);
 
-     out = ismacro(head) ?
-           apply(head, env, tail) :
-           new_cons(head, tail);
+     // Parts that expand to themselves are shared with the original
+     if (ismacro(head)) {
+       out = apply(head, env, tail);
+     } else if (head != car(out) || tail != cdr(out)) {
+       out = new_cons(head, tail);
+     }
+     release(2);
      break;
   }
  }  
@@ -78,30 +258,48 @@ lobj_t * lobj_expand(lobj_t * v, lobj_t ** env) {
 }
 
 
-lobj_t * apply(lobj_t * fun, lobj_t ** env, lobj_t * args) {
-  switch (fun->type) {
-  case LOBJ_PRIM:{
-    prim_t * body = toprim(fun);
-    args = (body->evaltype) == EVAL_PROC ? lobj_eval(args, env) : args;
-    return apply_prim(fun, env, args);
-  }case LOBJ_PROC:{
-     lambda_t * lmbody = toproc(fun);
-     args = (lmbody->evaltype) == EVAL_PROC ? lobj_eval(args, env) : args;
-     return apply_lambda(fun, args);
-  }default: return new_err("Type Error: expected type function, got %i", fun->type);
-    }
-}
+/*
+Calls from C. The function and its arguments are pushed on the VM stack, evaluating each
+argument straight into its slot if the function takes values, and a primitive reads its
+arguments from there, so a call neither conses an argument list nor mallocs.
+ */
+static lobj_t * call(lobj_t * fun, lobj_t ** env, lobj_t * args, int eval) {
+  size_t base = SP;
+  int argc = 0;
+  lobj_t * x;
 
-lobj_t * apply_prim(lobj_t * fun, lobj_t ** env, lobj_t * args) {
-  prim_t * pfun = toprim(fun);
-  lobj_t ** argstup = getargs(fun, args);
+  if (!isprim(fun) && !isproc(fun)) {
+    return new_err("Type Error: expected type function, got %i", lobj_type(fun));
+  }
 
-  return (pfun->body(argstup, env));
+  preserve(&args);
+  push(fun);
+
+  for (; iscons(args); args = cdr(args), argc++) {
+    x = eval ? lobj_eval(car(args), env) : car(args);
+    push(x);
+  }
+
+  release(1);
+  fun = STACK[base];
+
+  if (isproc(fun)) return vm_call(argc);
+
+  check_arity(fun, argc);
+  x = toprim(fun)->body(&STACK[base + 1], env);
+  SP = base;
+
+  return x;
 }
 
-lobj_t * apply_lambda(lobj_t * fun, lobj_t * args) {
-  lambda_t * lfun = toproc(fun);
-  lobj_t * bound_env = bind_args(lfun, args);
+// Call fun on the expressions args, evaluating them unless fun is a form or a macro
+lobj_t * apply(lobj_t * fun, lobj_t ** env, lobj_t * args) {
+  int evaltype = isprim(fun) ? toprim(fun)->evaltype : isproc(fun) ? toproc(fun)->evaltype : EVAL_PROC;
+
+  return call(fun, env, args, evaltype == EVAL_PROC);
+}
 
-  return lobj_eval(lfun->body, &bound_env);
+// Call fun on a list of values
+lobj_t * apply_values(lobj_t * fun, lobj_t ** env, lobj_t * args) {
+  return call(fun, env, args, 0);
 }
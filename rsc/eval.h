@@ -8,9 +8,10 @@
 /* Forward declarations */
 lobj_t * lobj_eval(lobj_t *, lobj_t **);
 lobj_t * lobj_expand(lobj_t *, lobj_t **);
-lobj_t * apply_lambda(lobj_t *, lobj_t *);
-lobj_t * apply_prim(lobj_t *, lobj_t **, lobj_t *);
 lobj_t * apply(lobj_t *, lobj_t **, lobj_t *);
-lobj_t * bind_args(lambda_t *, lobj_t *);
+lobj_t * apply_values(lobj_t *, lobj_t **, lobj_t *);
+lobj_t * resolve(lobj_t *, lobj_t *);
+int quotable(lobj_t *);
+lobj_t * expand_quotes(lobj_t *);
 
 #endif
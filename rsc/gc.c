@@ -1,94 +1,827 @@
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include "gc.h"
+#include "vm.h"
 
 
+// Release the resources owned by obj and mark its cell free. Safe to call from the sweeper.
+static void lobj_release(lobj_t * obj) {
+  switch (obj->type) {
+  case LOBJ_SYM: free(tosym(obj)->name); break;
+  case LOBJ_STR:
+    // A slice shares its base's chars
+    if (isnil(tostring(obj)->base)) free(tostring(obj)->chars);
+    break;
+  case LOBJ_STRBUF: free(tostrbuf(obj)->chars); break;
+  case LOBJ_ERR: free(toerr(obj)->msg); break;
+  case LOBJ_CODE:
+    free(tocode(obj)->instrs);
+    free(tocode(obj)->caches);
+    break;
+  default: break;
+  }
+
+  obj->type = LOBJ_FREE;
+}
+
+// Release the resources owned by obj and return its cell to the allocator. The cell is
+// threaded back onto its pool's free list by sweep_slab().
 void lobj_del(lobj_t * obj) {
   // Ignore null pointers
   if (obj == NULL) return;
 
+  lobj_release(obj);
+  ALLOCATIONS--;
+}
+
+
+/*
+Marking
+
+mark() is iterative. Reachable white objects are tagged GC_GREY and pushed on
+MARK_STACK; popping an object greys its children and tags it GC_BLACK, so the cost
+depends only on the number of live objects and not on how deep the structure is.
+
+If the stack cannot grow, the object being greyed is marked by pointer reversal
+(Deutsch-Schorr-Waite) instead. This needs no extra memory: the path back to the root
+is threaded through the fields being visited, and the index of the field in progress
+is kept in the upper bits of the tag.
+*/
+
+#define GC_INDEX(obj)          (((obj)->tag & ~GC_REMEMBERED) >> 2)
+#define GC_SET_INDEX(obj, i)   gc_paint(obj, GC_GREY | ((i) << 2))
+// Nursery objects are never marked: they are traced when a minor collection promotes them
+#define iswhite(obj)           ((obj) != NULL && isptr(obj) && !isyoung(obj) && GC_COLOR(obj) == GC_WHITE)
+
+// Return the address of the i-th pointer field of obj, or NULL past the last one
+static lobj_t ** lobj_field(lobj_t * obj, int i) {
   switch (obj->type) {
-  case LOBJ_SYM:{
-    sym_t * body = tosym(obj);
-    free(body->name);
-    free(body);
-    break;
-  }case LOBJ_STR:{
-     str_t * body = tostring(obj);
-     free(body->value);
-     free(body);
-     break;
-   }case LOBJ_PROC:{
-      lambda_t * pbody = toproc(obj);
-      free(pbody);
-      break;
-    }
-  case LOBJ_NUM: free(tonum(obj)); break;
-  case LOBJ_ERR:{
-    err_t * body = toerr(obj);
-    free(body->msg);
-    free(body);
-    break;
-   }case LOBJ_CONS:{
-    cons_t * body = tocons(obj);
-    free(body);
-    break;
+  case LOBJ_CONS:
+    return i == 0 ? &fcar(obj) : i == 1 ? &fcdr(obj) : NULL;
+  case LOBJ_PROC:{
+    lambda_t * lmb = (lambda_t*)obj;
+    return i == 0 ? &lmb->env : i == 1 ? &lmb->formals : i == 2 ? &lmb->body : i == 3 ? &lmb->code : NULL;
+  }case LOBJ_FRAME:{
+    frame_t * frame = (frame_t*)obj;
+    return i == 0 ? &frame->parent : i <= frame->size ? &frame->slots[i-1] : NULL;
+  }case LOBJ_LREF:
+    return i == 0 ? &((lref_t*)obj)->name : NULL;
+  case LOBJ_CODE:
+    return i < ((code_t*)obj)->nconsts ? &((code_t*)obj)->consts[i] : NULL;
+  case LOBJ_VEC:
+    return i < ((vec_t*)obj)->len ? &((vec_t*)obj)->items[i] : NULL;
+  case LOBJ_STR:
+    return i == 0 ? &((str_t*)obj)->base : NULL;
+  default:
+    return NULL;
+  }
+}
+
+static int stack_grow(lobj_t *** stack, size_t * cap) {
+  size_t newcap = *cap ? 2 * *cap : MARK_STACK_INIT;
+  if (newcap > MARK_STACK_MAX) return 0;
+
+  lobj_t ** grown = realloc(*stack, newcap * sizeof(lobj_t*));
+  if (grown == NULL) return 0;
+
+  *stack = grown;
+  *cap = newcap;
+  return 1;
+}
+
+#define mark_stack_grow() stack_grow(&MARK_STACK, &MARK_CAP)
+
+static void mark_reversed(lobj_t * obj) {
+  lobj_t * prev = NULL, * curr = obj, * next, ** field;
+
+  GC_SET_INDEX(curr, 0);
+
+  while (1) {
+    int i = GC_INDEX(curr);
+
+    if ((field = lobj_field(curr, i)) != NULL) {
+      GC_SET_INDEX(curr, i + 1);
+      next = *field;
+      if (!iswhite(next)) continue;
+      // Advance: the field now points back to the parent
+      *field = prev;
+      prev = curr;
+      curr = next;
+      GC_SET_INDEX(curr, 0);
+      continue;
     }
+
+    gc_paint(curr, GC_BLACK);
+    if (prev == NULL) return;
+
+    // Retreat: restore the parent's field and continue with its next field
+    field = lobj_field(prev, GC_INDEX(prev) - 1);
+    next = *field;
+    *field = curr;
+    curr = prev;
+    prev = next;
   }
+}
 
-  ALLOCATIONS--;
+void grey(lobj_t * obj) {
+  if (!iswhite(obj)) return;
+
+  if (MARK_SP == MARK_CAP && !mark_stack_grow()) {
+    mark_reversed(obj);
+    return;
+  }
+
+  gc_paint(obj, GC_GREY);
+  MARK_STACK[MARK_SP++] = obj;
 }
 
+static void blacken(lobj_t * obj) {
+  lobj_t ** field;
+
+  for (int i = 0; (field = lobj_field(obj, i)) != NULL; i++) grey(*field);
+  gc_paint(obj, GC_BLACK);
+}
 
 void mark(lobj_t * obj) {
-   // Ignore null pointers and red objects.
-  if (obj == NULL) return;
-  // This object has already been tagged
-  if (obj->tag == GC_BLACK) return;
+  grey(obj);
 
-  obj->tag = GC_BLACK;
+  while (MARK_SP > 0) blacken(MARK_STACK[--MARK_SP]);
+}
 
-  switch (obj->type) {
-    // Case 1: atomic objects (no references)
-  case LOBJ_NUM:
-  case LOBJ_ERR:
-  case LOBJ_SYM:
-  case LOBJ_STR:
-  case LOBJ_PRIM:
-  case LOBJ_FORM:
-    break;
-    // Case 2: pairs
-  case LOBJ_CONS:{
-    mark(fcar(obj));
-    mark(fcdr(obj));
-    break;
-     // Case 4: procedures
-   }case LOBJ_PROC:{
-      lambda_t * lmb = toproc(obj);
-      mark(LOBJ_CAST(lmb->env));
-      mark(LOBJ_CAST(lmb->body));
-      break;
-     }
+/*
+Parallel marking
+
+When GC_THREADS is above 1 and the old space holds at least PARALLEL_MARK_MIN objects,
+the grey objects left at the end of a collection are traced by GC_THREADS markers: the
+collecting thread and helpers started for the purpose. The mutator is stopped, so only
+the colours change. A marker claims a white object by turning it grey with a
+compare-and-swap, so every object is scanned by exactly one marker.
+
+Each marker keeps its grey objects on a Chase-Lev deque. The owner pushes and pops at the
+bottom, and a marker that runs out steals from the top of another's. Only a busy marker
+can push, so marking is over once every marker is idle. Rings outgrown by a deque may
+still be read by a thief and are freed after the markers have been joined.
+*/
+
+#ifndef PARALLEL_MARK_MIN
+#define PARALLEL_MARK_MIN (1 << 16)
+#endif
+#define RING_INIT 1024
+
+typedef struct _ring_t {
+  int64_t size;
+  struct _ring_t * prev;
+  lobj_t * cells[];
+} ring_t;
+
+typedef struct _marker_t {
+  int64_t top;
+  int64_t bottom;
+  ring_t * ring;
+  pthread_t thread;
+  rascal_ctx * ctx;
+  struct _pmark_t * pm;
+} __attribute__((aligned(64))) marker_t;
+
+typedef struct _pmark_t {
+  marker_t * markers;
+  int count;
+  int active;
+} pmark_t;
+
+static ring_t * ring_new(int64_t size, ring_t * prev) {
+  ring_t * ring = malloc(sizeof(ring_t) + size * sizeof(lobj_t*));
+
+  // Helpers have no handler of their own to raise an error to
+  if (ring == NULL) {
+    fputs("Out of memory while marking.\n", stderr);
+    exit(1);
+  }
+
+  ring->size = size;
+  ring->prev = prev;
+
+  return ring;
+}
+
+static void deque_push(marker_t * m, lobj_t * obj) {
+  int64_t b = __atomic_load_n(&m->bottom, __ATOMIC_RELAXED);
+  int64_t t = __atomic_load_n(&m->top, __ATOMIC_ACQUIRE);
+  ring_t * ring = m->ring;
+
+  if (b - t >= ring->size) {
+    ring_t * grown = ring_new(2 * ring->size, ring);
+    for (int64_t i = t; i < b; i++) grown->cells[i & (grown->size - 1)] = ring->cells[i & (ring->size - 1)];
+    __atomic_store_n(&m->ring, grown, __ATOMIC_RELEASE);
+    ring = grown;
   }
+
+  __atomic_store_n(&ring->cells[b & (ring->size - 1)], obj, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&m->bottom, b + 1, __ATOMIC_RELAXED);
 }
 
-void sweep() {
-  lobj_t * deathrow, * prev = ALLOC, * curr = ALLOC;
-  while (curr) {
-    if (curr->tag == GC_WHITE)  {
-      deathrow = curr;
-      prev->next = curr->next;
-      curr = curr->next;
-      lobj_del(deathrow);
+static lobj_t * deque_take(marker_t * m) {
+  int64_t b = __atomic_load_n(&m->bottom, __ATOMIC_RELAXED) - 1;
+  ring_t * ring = m->ring;
+  lobj_t * obj = NULL;
+
+  __atomic_store_n(&m->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t t = __atomic_load_n(&m->top, __ATOMIC_RELAXED);
+
+  if (t <= b) {
+    obj = __atomic_load_n(&ring->cells[b & (ring->size - 1)], __ATOMIC_RELAXED);
+    if (t < b) return obj;
+    // The last object: race any thief for it
+    if (!__atomic_compare_exchange_n(&m->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) obj = NULL;
+  }
+
+  __atomic_store_n(&m->bottom, b + 1, __ATOMIC_RELAXED);
+  return obj;
+}
+
+static lobj_t * deque_steal(marker_t * m) {
+  int64_t t = __atomic_load_n(&m->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t b = __atomic_load_n(&m->bottom, __ATOMIC_ACQUIRE);
+
+  if (t >= b) return NULL;
+
+  ring_t * ring = __atomic_load_n(&m->ring, __ATOMIC_ACQUIRE);
+  lobj_t * obj = __atomic_load_n(&ring->cells[t & (ring->size - 1)], __ATOMIC_RELAXED);
+
+  if (!__atomic_compare_exchange_n(&m->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return NULL;
+
+  return obj;
+}
+
+// Turn obj from white to grey, returning whether this marker was the one to do it
+static int claim(lobj_t * obj) {
+  if (obj == NULL || !isptr(obj) || isyoung(obj)) return 0;
+
+  int tag = __atomic_load_n(&obj->tag, __ATOMIC_RELAXED);
+
+  do {
+    if ((tag & 3) != GC_WHITE) return 0;
+  } while (!__atomic_compare_exchange_n(&obj->tag, &tag, (tag & GC_REMEMBERED) | GC_GREY, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return 1;
+}
+
+static void pblacken(marker_t * m, lobj_t * obj) {
+  lobj_t ** field;
+
+  for (int i = 0; (field = lobj_field(obj, i)) != NULL; i++) {
+    if (claim(*field)) deque_push(m, *field);
+  }
+
+  __atomic_store_n(&obj->tag, (obj->tag & GC_REMEMBERED) | GC_BLACK, __ATOMIC_RELAXED);
+}
+
+static lobj_t * steal_any(marker_t * m) {
+  pmark_t * pm = m->pm;
+  int self = m - pm->markers;
+  lobj_t * obj;
+
+  for (int k = 1; k < pm->count; k++) {
+    if ((obj = deque_steal(&pm->markers[(self + k) % pm->count])) != NULL) return obj;
+  }
+
+  return NULL;
+}
+
+static int work_left(marker_t * m) {
+  pmark_t * pm = m->pm;
+
+  for (int i = 0; i < pm->count; i++) {
+    marker_t * v = &pm->markers[i];
+    if (__atomic_load_n(&v->top, __ATOMIC_ACQUIRE) < __atomic_load_n(&v->bottom, __ATOMIC_ACQUIRE)) return 1;
+  }
+
+  return 0;
+}
+
+static void pmark_run(marker_t * m) {
+  lobj_t * obj;
+
+  while (1) {
+    while ((obj = deque_take(m)) != NULL) pblacken(m, obj);
+
+    if ((obj = steal_any(m)) != NULL) {
+      pblacken(m, obj);
       continue;
     }
-    curr->tag = GC_WHITE;
-    prev = curr;
-    curr = curr->next;
+
+    __atomic_sub_fetch(&m->pm->active, 1, __ATOMIC_SEQ_CST);
+
+    while (!work_left(m)) {
+      if (__atomic_load_n(&m->pm->active, __ATOMIC_SEQ_CST) == 0) return;
+      sched_yield();
+    }
+
+    __atomic_add_fetch(&m->pm->active, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void * pmark_helper(void * arg) {
+  marker_t * m = arg;
+
+  RASCAL = m->ctx;
+  pmark_run(m);
+
+  return NULL;
+}
+
+// Trace everything reachable from the mark stack with GC_THREADS markers
+static void mark_parallel() {
+  pmark_t pm = { NULL, GC_THREADS, GC_THREADS };
+  int started = 1;
+
+  pm.markers = aligned_alloc(64, pm.count * sizeof(marker_t));
+  if (pm.markers == NULL) return;
+
+  for (int i = 0; i < pm.count; i++) {
+    pm.markers[i] = (marker_t){ .ring = ring_new(RING_INIT, NULL), .ctx = RASCAL, .pm = &pm };
+  }
+
+  while (MARK_SP > 0) deque_push(&pm.markers[0], MARK_STACK[--MARK_SP]);
+
+  for (; started < pm.count; started++) {
+    if (pthread_create(&pm.markers[started].thread, NULL, pmark_helper, &pm.markers[started]) != 0) break;
+  }
+
+  // Markers that could not be started count as idle from the outset
+  __atomic_sub_fetch(&pm.active, pm.count - started, __ATOMIC_SEQ_CST);
+  pmark_run(&pm.markers[0]);
+
+  for (int i = 1; i < started; i++) pthread_join(pm.markers[i].thread, NULL);
+
+  for (int i = 0; i < pm.count; i++) {
+    for (ring_t * ring = pm.markers[i].ring, * prev; ring != NULL; ring = prev) {
+      prev = ring->prev;
+      free(ring);
     }
   }
 
-  void gc() {
-    mark(GLOBALS);
-    mark(ROOT);
-    sweep();
+  free(pm.markers);
+}
+
+// Trace the grey objects on the mark stack to the end
+static void mark_drain() {
+  if (GC_THREADS > 1 && ALLOCATIONS >= PARALLEL_MARK_MIN) mark_parallel();
+
+  while (MARK_SP > 0) blacken(MARK_STACK[--MARK_SP]);
+}
+
+/*
+Sweeping
+
+sweep_begin moves every slab onto its pool's unswept list and empties the free lists.
+sweep_slab then frees the unmarked objects in one slab, resets the survivors to white and
+threads the free cells together in address order; a slab with no survivors is returned
+to the system. New objects are only ever allocated from swept slabs, so they cannot be
+mistaken for garbage. Large objects are swept all at once.
+
+Slabs are swept by a background thread that each context starts in init_gc, so a
+collection's pause ends with marking. On a single core the thread would only take time
+from the mutator, so it is not started and gc_step sweeps in slices instead. The sweeper only reads the types and colours of
+the objects in the slab it has taken and frees the dead ones, which nothing can reach;
+the only field the mutator can change under it is GC_REMEMBERED, so the tag is updated
+atomically on both sides. Swept slabs and their free cells are left on the pool's swept
+list until the mutator takes them with sweep_adopt, which keeps the free lists and
+ALLOCATIONS the mutator's own. An allocation that finds nothing to adopt sweeps a slab
+itself rather than wait.
+*/
+
+#define UNSWEPT_SLABS (RASCAL->unswept_slabs)
+
+static void sweep_done() {
+  GC_STATE = GC_IDLE;
+  GC_THRESHOLD = 2 * ALLOCATIONS > ALLOCATIONS_LIMIT ? 2 * ALLOCATIONS : ALLOCATIONS_LIMIT;
+}
+
+// Sweep a slab from the pool's unswept list onto its swept list. Called by the sweeper
+// and by the mutator; returns 0 if there was nothing left to sweep.
+int sweep_slab(pool_t * pool) {
+  lobj_t * head = NULL, * tail = NULL;
+  size_t nfree = 0;
+  int dead = 0;
+
+  pthread_mutex_lock(&SWEEP_LOCK);
+  slab_t * slab = pool->unswept;
+  if (slab != NULL) {
+    pool->unswept = slab->next;
+    SWEEP_BUSY++;
   }
-  
+  pthread_mutex_unlock(&SWEEP_LOCK);
+
+  if (slab == NULL) return 0;
+
+  for (size_t i = slab->ncells; i-- > 0;) {
+    lobj_t * obj = slab_cell(slab, i);
+
+    if (obj->type != LOBJ_FREE) {
+      if ((__atomic_load_n(&obj->tag, __ATOMIC_RELAXED) & 3) != GC_WHITE) {
+        __atomic_fetch_and(&obj->tag, GC_REMEMBERED, __ATOMIC_RELAXED);
+        continue;
+      }
+      lobj_release(obj);
+      dead++;
+    }
+
+    ((free_t*)obj)->next = head;
+    head = obj;
+    if (tail == NULL) tail = obj;
+    nfree++;
+  }
+
+  pthread_mutex_lock(&SWEEP_LOCK);
+
+  if (nfree == slab->ncells) {
+    pool->swept_released++;
+  } else {
+    slab->next = pool->swept;
+    pool->swept = slab;
+
+    if (tail != NULL) {
+      ((free_t*)tail)->next = pool->swept_free;
+      if (pool->swept_free == NULL) pool->swept_tail = tail;
+      pool->swept_free = head;
+      pool->swept_nfree += nfree;
+    }
+  }
+
+  SWEPT_DEAD += dead;
+  UNSWEPT_SLABS--;
+  if (--SWEEP_BUSY == 0 && UNSWEPT_SLABS == 0) pthread_cond_broadcast(&SWEEP_IDLE);
+  pthread_mutex_unlock(&SWEEP_LOCK);
+
+  if (nfree == slab->ncells) free(slab);
+
+  return 1;
+}
+
+// Move the slabs and free cells swept in pool onto its slabs and free list
+void sweep_adopt(pool_t * pool) {
+  pthread_mutex_lock(&SWEEP_LOCK);
+
+  while (pool->swept != NULL) {
+    slab_t * slab = pool->swept;
+    pool->swept = slab->next;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+  }
+
+  if (pool->swept_free != NULL) {
+    ((free_t*)pool->swept_tail)->next = pool->free;
+    pool->free = pool->swept_free;
+    pool->nfree += pool->swept_nfree;
+    pool->swept_free = pool->swept_tail = NULL;
+    pool->swept_nfree = 0;
+  }
+
+  pool->nslabs -= pool->swept_released;
+  pool->swept_released = 0;
+  ALLOCATIONS -= SWEPT_DEAD;
+  SWEPT_DEAD = 0;
+
+  pthread_mutex_unlock(&SWEEP_LOCK);
+}
+
+static void * sweeper_main(void * ctx) {
+  RASCAL = ctx;
+
+  pthread_mutex_lock(&SWEEP_LOCK);
+
+  while (!SWEEP_QUIT) {
+    if (UNSWEPT_SLABS == (size_t)SWEEP_BUSY) {
+      pthread_cond_wait(&SWEEP_WORK, &SWEEP_LOCK);
+      continue;
+    }
+
+    pthread_mutex_unlock(&SWEEP_LOCK);
+    for (int p = 0; p < NPOOLS; p++) {
+      while (sweep_slab(&POOLS[p]));
+    }
+    pthread_mutex_lock(&SWEEP_LOCK);
+  }
+
+  pthread_mutex_unlock(&SWEEP_LOCK);
+  return NULL;
+}
+
+// Adopt whatever has been swept, and finish the cycle if that is everything
+static void sweep_poll() {
+  pthread_mutex_lock(&SWEEP_LOCK);
+  int done = UNSWEPT_SLABS == 0;
+  pthread_mutex_unlock(&SWEEP_LOCK);
+
+  for (int p = 0; p < NPOOLS; p++) sweep_adopt(&POOLS[p]);
+  if (done) sweep_done();
+}
+
+static void sweep_begin() {
+  int empty;
+
+  GC_STATE = GC_SWEEPING;
+
+  pthread_mutex_lock(&SWEEP_LOCK);
+  UNSWEPT_SLABS = 0;
+
+  for (int p = 0; p < NPOOLS; p++) {
+    pool_t * pool = &POOLS[p];
+
+    for (slab_t * slab = pool->slabs; slab; slab = slab->next) UNSWEPT_SLABS++;
+    pool->unswept = pool->slabs;
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->nfree = 0;
+  }
+
+  empty = UNSWEPT_SLABS == 0;
+  pthread_cond_signal(&SWEEP_WORK);
+  pthread_mutex_unlock(&SWEEP_LOCK);
+
+  large_t * deathrow, ** curr = &LARGE;
+  while (*curr) {
+    if (GC_COLOR(large_obj(*curr)) == GC_WHITE)  {
+      deathrow = *curr;
+      *curr = deathrow->next;
+      lobj_del(large_obj(deathrow));
+      free(deathrow);
+      continue;
+    }
+    gc_paint(large_obj(*curr), GC_WHITE);
+    curr = &((*curr)->next);
+  }
+
+  if (empty) sweep_done();
+}
+
+// Sweep whatever is left, wait for the sweeper and end the cycle
+void sweep_finish() {
+  for (int p = 0; p < NPOOLS; p++) {
+    while (sweep_slab(&POOLS[p]));
+  }
+
+  pthread_mutex_lock(&SWEEP_LOCK);
+  while (SWEEP_BUSY > 0) pthread_cond_wait(&SWEEP_IDLE, &SWEEP_LOCK);
+  pthread_mutex_unlock(&SWEEP_LOCK);
+
+  for (int p = 0; p < NPOOLS; p++) sweep_adopt(&POOLS[p]);
+  if (GC_STATE == GC_SWEEPING) sweep_done();
+}
+
+void sweep() {
+  sweep_begin();
+  sweep_finish();
+}
+
+/*
+Minor collection
+
+Live nursery objects are copied into the old space, leaving a forwarding pointer
+behind, and the nursery is reset. The roots are ROOT, the shadow stack, the VM
+registers and the remembered set, which the write barrier keeps up to date, so the cost is proportional to the number of
+survivors and remembered objects rather than to the size of the heap. Copied objects
+are queued on PROMOTE_STACK until their own fields have been evacuated.
+
+While the incremental marker is running, a young object stored into a grey or black
+object (or a root) is greyed once it has been copied, since the marker has already
+passed the object pointing to it. Copies referenced only from white objects stay white
+and are traced, like any other old object, if their referents turn out to be live.
+*/
+
+void remember(lobj_t * obj) {
+  if (REMSET_COUNT == REMSET_CAP) {
+    REMSET_CAP = REMSET_CAP ? 2 * REMSET_CAP : 256;
+    REMSET = realloc(REMSET, REMSET_CAP * sizeof(lobj_t*));
+  }
+
+  __atomic_fetch_or(&obj->tag, GC_REMEMBERED, __ATOMIC_RELAXED);
+  REMSET[REMSET_COUNT++] = obj;
+}
+
+void remember_global(gbind_t * binding) {
+  if (REMSET_GLOBALS_COUNT == REMSET_GLOBALS_CAP) {
+    REMSET_GLOBALS_CAP = REMSET_GLOBALS_CAP ? 2 * REMSET_GLOBALS_CAP : 64;
+    REMSET_GLOBALS = realloc(REMSET_GLOBALS, REMSET_GLOBALS_CAP * sizeof(gbind_t*));
+  }
+
+  binding->remembered = 1;
+  REMSET_GLOBALS[REMSET_GLOBALS_COUNT++] = binding;
+}
+
+static void scan_promoted(lobj_t *);
+
+static void evacuate(lobj_t ** slot) {
+  lobj_t * obj = *slot;
+
+  if (!isyoung(obj)) return;
+
+  if (obj->type == LOBJ_FWD) {
+    *slot = ((fwd_t*)obj)->to;
+    return;
+  }
+
+  size_t size = lobj_size(obj);
+  lobj_t * copy = lobj_alloc_old(obj->type, size);
+  memcpy(copy, obj, size);
+  copy->tag = GC_WHITE;
+
+  obj->type = LOBJ_FWD;
+  obj->tag = (int)size;
+  ((fwd_t*)obj)->to = copy;
+  *slot = copy;
+
+  if (PROMOTE_SP == PROMOTE_CAP && !stack_grow(&PROMOTE_STACK, &PROMOTE_CAP)) {
+    scan_promoted(copy);
+    return;
+  }
+
+  PROMOTE_STACK[PROMOTE_SP++] = copy;
+}
+
+static void scan_promoted(lobj_t * obj) {
+  lobj_t ** field;
+  int shade = GC_STATE == GC_MARKING && GC_COLOR(obj) != GC_WHITE;
+
+  for (int i = 0; (field = lobj_field(obj, i)) != NULL; i++) {
+    evacuate(field);
+    if (shade) grey(*field);
+  }
+}
+
+void minor_gc() {
+  int shade = GC_STATE == GC_MARKING;
+
+  evacuate(&ROOT);
+  if (shade) grey(ROOT);
+
+  for (size_t i = 0; i < SHADOW_SP; i++) {
+    evacuate(SHADOW[i]);
+    if (shade) grey(*SHADOW[i]);
+  }
+
+  evacuate(&ACCUM);
+  evacuate(&ENV);
+  for (size_t i = 0; i < SP; i++) evacuate(&STACK[i]);
+  if (shade) {
+    grey(ACCUM);
+    grey(ENV);
+    for (size_t i = 0; i < SP; i++) grey(STACK[i]);
+  }
+
+  for (size_t i = 0; i < REMSET_GLOBALS_COUNT; i++) {
+    REMSET_GLOBALS[i]->remembered = 0;
+    evacuate(&REMSET_GLOBALS[i]->value);
+    if (shade) grey(REMSET_GLOBALS[i]->value);
+  }
+
+  for (size_t i = 0; i < REMSET_COUNT; i++) {
+    __atomic_fetch_and(&REMSET[i]->tag, ~GC_REMEMBERED, __ATOMIC_RELAXED);
+    scan_promoted(REMSET[i]);
+  }
+
+  while (PROMOTE_SP > 0) scan_promoted(PROMOTE_STACK[--PROMOTE_SP]);
+
+  REMSET_COUNT = 0;
+  REMSET_GLOBALS_COUNT = 0;
+  NURSERY_TOP = NURSERY;
+}
+
+void mark_globals() {
+  for (size_t i = 0; i < GLOBALS_CAP; i++) {
+    if (GLOBALS[i] == NULL) continue;
+    grey(GLOBALS[i]->name);
+    grey(GLOBALS[i]->value);
+  }
+}
+
+static void mark_roots() {
+  grey(CLOSURE);
+  grey(CONSTANT);
+  grey(ROOT);
+  for (size_t i = 0; i < SHADOW_SP; i++) grey(*SHADOW[i]);
+  grey(ACCUM);
+  grey(ENV);
+  grey(CODE);
+  for (size_t i = 0; i < SP; i++) grey(STACK[i]);
+}
+
+/*
+Incremental collection
+
+A cycle starts when the old space passes GC_THRESHOLD: the roots are greyed and marking
+then advances a slice at a time from lobj_alloc, GC_STEP_INTERVAL allocations apart. A
+slice stops after GC_STEP_WORK objects or GC_PAUSE_US microseconds, whichever comes
+first, so marking keeps ahead of allocation without long pauses. Stores made in the
+meantime are caught by the write barrier.
+
+Once the mark stack runs dry the cycle is finished: the nursery is emptied, the roots
+are greyed again, since the shadow stack and ROOT change without a barrier, and the
+remaining grey objects are traced. Sweeping then proceeds in the background (see sweep_slab).
+*/
+
+#define GC_STEP_WORK (4 * GC_STEP_INTERVAL)
+
+static long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void init_gc() {
+  char * pause = getenv("RASCAL_GC_PAUSE_US"), * threads = getenv("RASCAL_GC_THREADS");
+  char * sweeper = getenv("RASCAL_GC_SWEEPER");
+
+  GC_PAUSE_US = pause ? atol(pause) : GC_PAUSE_DEFAULT;
+  GC_THREADS = threads ? atoi(threads) : 1;
+  GC_STATE = GC_IDLE;
+  GC_THRESHOLD = ALLOCATIONS_LIMIT;
+
+  pthread_mutex_init(&SWEEP_LOCK, NULL);
+  pthread_cond_init(&SWEEP_WORK, NULL);
+  pthread_cond_init(&SWEEP_IDLE, NULL);
+  SWEEP_BUSY = SWEEP_QUIT = SWEPT_DEAD = 0;
+  UNSWEPT_SLABS = 0;
+  SWEEP_THREAD = sweeper ? atoi(sweeper) : sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  if (SWEEP_THREAD) pthread_create(&SWEEPER, NULL, sweeper_main, RASCAL);
+}
+
+// Stop the sweeper and finish its work, leaving the heap to free_alloc
+void free_gc() {
+  if (SWEEP_THREAD) {
+    pthread_mutex_lock(&SWEEP_LOCK);
+    SWEEP_QUIT = 1;
+    pthread_cond_signal(&SWEEP_WORK);
+    pthread_mutex_unlock(&SWEEP_LOCK);
+    pthread_join(SWEEPER, NULL);
+  }
+
+  if (GC_STATE == GC_SWEEPING) sweep_finish();
+  pthread_mutex_destroy(&SWEEP_LOCK);
+  pthread_cond_destroy(&SWEEP_WORK);
+  pthread_cond_destroy(&SWEEP_IDLE);
+
+  free(MARK_STACK);
+  free(PROMOTE_STACK);
+  free(REMSET);
+  free(REMSET_GLOBALS);
+}
+
+void gc_start() {
+  if (GC_STATE == GC_SWEEPING) sweep_finish();
+
+  GC_STATE = GC_MARKING;
+  GC_STEP_COUNT = 0;
+  mark_globals();
+  mark_roots();
+}
+
+static void gc_finish() {
+  minor_gc();
+  mark_roots();
+  mark_drain();
+  symtab_sweep();
+  sweep_begin();
+}
+
+void gc_step() {
+  long deadline = now_us() + GC_PAUSE_US;
+
+  GC_STEP_COUNT = 0;
+
+  if (GC_STATE == GC_MARKING) {
+    for (int n = 1; MARK_SP > 0 && n <= GC_STEP_WORK; n++) {
+      blacken(MARK_STACK[--MARK_SP]);
+      if (n % 64 == 0 && now_us() >= deadline) return;
+    }
+    if (MARK_SP == 0) gc_finish();
+  } else if (GC_STATE == GC_SWEEPING) {
+    // Without a sweeper the slabs are swept here, a slice at a time
+    for (int p = 0; !SWEEP_THREAD && p < NPOOLS; p++) {
+      while (now_us() < deadline && sweep_slab(&POOLS[p]));
+    }
+    sweep_poll();
+  }
+}
+
+// Run a complete collection, finishing any cycle already in progress. The heap is left
+// to the sweeper.
+void gc() {
+  if (GC_STATE == GC_SWEEPING) sweep_finish();
+  if (GC_STATE == GC_IDLE) gc_start();
+
+  gc_finish();
+}
+
+// Called between top-level forms, when the nursery is cheapest to empty
+void gc_safepoint() {
+  if (GC_STATE == GC_MARKING) gc_finish();
+  else minor_gc();
+}
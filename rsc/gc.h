@@ -2,13 +2,54 @@
 #define gc_h
 #include "rascal.h"
 #include "object.h"
+#include "alloc.h"
+
+// Mark stack. Grows on demand up to MARK_STACK_MAX entries.
+#define MARK_STACK_INIT 1024
+#ifndef MARK_STACK_MAX
+#define MARK_STACK_MAX (1 << 24)
+#endif
+#define MARK_STACK (RASCAL->mark_stack)
+#define MARK_SP    (RASCAL->mark_sp)
+#define MARK_CAP   (RASCAL->mark_cap)
+
+// Promoted objects whose fields have not been evacuated yet
+#define PROMOTE_STACK (RASCAL->promote_stack)
+#define PROMOTE_SP    (RASCAL->promote_sp)
+#define PROMOTE_CAP   (RASCAL->promote_cap)
+
+// Remembered set: old objects and global bindings that may point into the nursery
+#define REMSET               (RASCAL->remset)
+#define REMSET_COUNT         (RASCAL->remset_count)
+#define REMSET_CAP           (RASCAL->remset_cap)
+#define REMSET_GLOBALS       (RASCAL->remset_globals)
+#define REMSET_GLOBALS_COUNT (RASCAL->remset_globals_count)
+#define REMSET_GLOBALS_CAP   (RASCAL->remset_globals_cap)
+
+// Background sweeper (see sweep_slab). SWEEP_LOCK guards the unswept and swept lists of
+// the pools, UNSWEPT_SLABS, SWEEP_BUSY (slabs being swept), SWEEP_QUIT and SWEPT_DEAD
+// (objects freed but not yet taken off ALLOCATIONS). SWEEP_THREAD is set if the sweeper
+// was started: by default when there is more than one core, or by RASCAL_GC_SWEEPER.
+#define SWEEPER      (RASCAL->sweeper)
+#define SWEEP_THREAD (RASCAL->sweep_thread)
+#define SWEEP_LOCK (RASCAL->sweep_lock)
+#define SWEEP_WORK (RASCAL->sweep_work)
+#define SWEEP_IDLE (RASCAL->sweep_idle)
+#define SWEEP_BUSY (RASCAL->sweep_busy)
+#define SWEEP_QUIT (RASCAL->sweep_quit)
+#define SWEPT_DEAD (RASCAL->swept_dead)
 
 /* Forward Declarations  */
 
 // GC & memory management
 void lobj_del(lobj_t*);
+void init_gc();
+void free_gc();
 void gc();
+void minor_gc();
+void gc_safepoint();
 void mark(lobj_t *);
+void mark_globals();
 void sweep();
 
 #endif
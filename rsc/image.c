@@ -0,0 +1,436 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "util.h"
+#include "vm.h"
+#include "alloc.h"
+
+// The mapped image, if one was opened
+static uint64_t * IMAGE;
+static size_t IMAGE_LEN;
+
+// Words holding len bytes and the NUL after them
+#define byte_words(len) ((len) / 8 + 1)
+
+// Hash of the names and arities of the primitives, which an image's indices depend on
+static uint64_t prim_signature() {
+  uint64_t h = IMAGE_MAGIC;
+
+  for (int i = 0; i < NPRIMITIVES; i++) {
+    h = h * 31 + hash_mem(PRIMITIVES[i].name, strlen(PRIMITIVES[i].name));
+    h = h * 31 + PRIMITIVES[i].argc * 4 + PRIMITIVES[i].evaltype;
+  }
+
+  return h;
+}
+
+// CLOSURE and CONSTANT are not bound, so they follow the last index in PRIMITIVES
+static int prim_index(lobj_t * obj) {
+  if (obj == CLOSURE) return NPRIMITIVES;
+  if (obj == CONSTANT) return NPRIMITIVES + 1;
+
+  for (int i = 0; i < NPRIMITIVES; i++) {
+    if (PRIMITIVES[i].body == toprim(obj)->body) return i;
+  }
+
+  return -1;
+}
+
+
+/*
+Writing. Objects are numbered (from 1) as they are first referred to and queued on
+objs, and their records are written in that order, so the heap is walked breadth first
+without recursion.
+*/
+typedef struct _writer_t {
+  uint64_t * words;
+  size_t len;
+  size_t cap;
+  lobj_t ** objs;
+  size_t nobjs;
+  size_t objcap;
+  ptrmap_t index;
+  // The type of an object that can't be saved, or -1
+  int bad;
+} writer_t;
+
+static void emit(writer_t * w, uint64_t word) {
+  if (w->len == w->cap) {
+    w->cap = w->cap ? 2 * w->cap : 4096;
+    w->words = realloc(w->words, w->cap * sizeof(uint64_t));
+  }
+
+  w->words[w->len++] = word;
+}
+
+static void emit_bytes(writer_t * w, char * bytes, size_t len) {
+  size_t n = byte_words(len);
+
+  emit(w, len);
+  for (size_t i = 0; i < n; i++) emit(w, 0);
+  memcpy(w->words + w->len - n, bytes, len);
+}
+
+static uint64_t ref(writer_t * w, lobj_t * obj) {
+  unsigned * n;
+
+  if (!isptr(obj)) return (uint64_t)obj;
+
+  n = ptrmap_slot(&w->index, obj);
+  if (*n == 0) {
+    if (w->nobjs == w->objcap) {
+      w->objcap = w->objcap ? 2 * w->objcap : 1024;
+      w->objs = realloc(w->objs, w->objcap * sizeof(lobj_t*));
+    }
+
+    w->objs[w->nobjs++] = obj;
+    *n = w->nobjs;
+  }
+
+  return (uint64_t)*n << 2;
+}
+
+static void write_record(writer_t * w, lobj_t * obj) {
+  emit(w, obj->type);
+
+  switch (obj->type) {
+  case LOBJ_CONS:
+    emit(w, ref(w, fcar(obj)));
+    emit(w, ref(w, fcdr(obj)));
+    break;
+  case LOBJ_NUM:
+    emit(w, tonum(obj));
+    break;
+  case LOBJ_SYM:
+    emit_bytes(w, tosym(obj)->name, strlen(tosym(obj)->name));
+    break;
+  case LOBJ_STR:
+    emit_bytes(w, tostring(obj)->chars, tostring(obj)->len);
+    break;
+  case LOBJ_ERR:
+    emit_bytes(w, toerr(obj)->msg, strlen(toerr(obj)->msg));
+    break;
+  case LOBJ_PRIM:
+    if (prim_index(obj) < 0) w->bad = LOBJ_PRIM;
+    emit(w, prim_index(obj));
+    emit(w, toprim(obj)->argc);
+    emit(w, toprim(obj)->vararg);
+    emit(w, toprim(obj)->evaltype);
+    break;
+  case LOBJ_PROC:
+    emit(w, toproc(obj)->argc);
+    emit(w, toproc(obj)->vararg);
+    emit(w, toproc(obj)->evaltype);
+    emit(w, ref(w, toproc(obj)->formals));
+    emit(w, ref(w, toproc(obj)->body));
+    emit(w, ref(w, toproc(obj)->env));
+    break;
+  case LOBJ_FRAME:
+    emit(w, toframe(obj)->size);
+    emit(w, ref(w, toframe(obj)->parent));
+    for (int i = 0; i < toframe(obj)->size; i++) emit(w, ref(w, toframe(obj)->slots[i]));
+    break;
+  case LOBJ_LREF:
+    emit(w, tolref(obj)->depth);
+    emit(w, tolref(obj)->slot);
+    emit(w, ref(w, tolref(obj)->name));
+    break;
+  case LOBJ_VEC:
+    emit(w, tovec(obj)->len);
+    for (long i = 0; i < tovec(obj)->len; i++) emit(w, ref(w, tovec(obj)->items[i]));
+    break;
+  case LOBJ_ARR:
+    emit(w, toarr(obj)->len);
+    for (long i = 0; i < toarr(obj)->len; i++) emit(w, toarr(obj)->items[i]);
+    break;
+  case LOBJ_STRBUF:
+    emit(w, tostrbuf(obj)->cap);
+    emit_bytes(w, tostrbuf(obj)->chars, tostrbuf(obj)->len);
+    break;
+  default:
+    w->bad = obj->type;
+  }
+}
+
+// Write the global environment to the file args[0]. Returns the number of objects written.
+lobj_t * prim_save_image(lobj_t * args[1], lobj_t ** env) {
+  writer_t w = { .bad = -1 };
+  char fname[PATH_MAX];
+  size_t nglobals = 0, nobjs;
+  FILE * f = NULL;
+  int ok;
+
+  snprintf(fname, sizeof(fname), "%.*s", (int)tostring(args[0])->len, tostring(args[0])->chars);
+
+  emit(&w, IMAGE_MAGIC);
+  emit(&w, prim_signature());
+  emit(&w, 0);
+  emit(&w, 0);
+
+  for (size_t i = 0; i < GLOBALS_CAP; i++) {
+    if (GLOBALS[i] == NULL) continue;
+    emit(&w, ref(&w, GLOBALS[i]->name));
+    emit(&w, ref(&w, GLOBALS[i]->value));
+    nglobals++;
+  }
+
+  for (size_t i = 0; i < w.nobjs && w.bad < 0; i++) write_record(&w, w.objs[i]);
+  w.words[2] = nglobals;
+  w.words[3] = nobjs = w.nobjs;
+
+  if (w.bad < 0) f = fopen(fname, "wb");
+  ok = f != NULL && fwrite(w.words, sizeof(uint64_t), w.len, f) == w.len;
+  if (f != NULL) ok &= fclose(f) == 0;
+
+  free(w.words);
+  free(w.objs);
+  ptrmap_free(&w.index);
+
+  LASSERT(w.bad < 0, "Type Error: cannot save an object of type %i in an image", w.bad)
+  LASSERT(ok, "File Error: could not write %s", fname)
+  return new_num(nobjs);
+}
+
+
+/* Reading */
+// The length of the record at p in words, or 0 if it is malformed or runs past avail
+static size_t record_size(uint64_t * p, size_t avail) {
+  size_t n;
+
+  if (avail < 3) return avail == 2 && p[0] == LOBJ_NUM ? 2 : 0;
+
+  switch (p[0]) {
+  case LOBJ_CONS:   n = 3; break;
+  case LOBJ_NUM:    n = 2; break;
+  case LOBJ_PRIM:   n = p[1] <= (uint64_t)NPRIMITIVES + 1 ? 5 : 0; break;
+  case LOBJ_PROC:   n = 7; break;
+  case LOBJ_LREF:   n = 4; break;
+  case LOBJ_FRAME:  n = p[1] < avail && p[1] <= INT_MAX ? 3 + p[1] : 0; break;
+  case LOBJ_VEC:    n = p[1] < avail && p[1] <= VEC_MAX ? 2 + p[1] : 0; break;
+  case LOBJ_ARR:    n = p[1] < avail && p[1] <= ARR_MAX ? 2 + p[1] : 0; break;
+  case LOBJ_SYM:
+  case LOBJ_STR:
+  case LOBJ_ERR:
+    n = p[1] < 8 * (avail - 2) && ((char*)(p + 2))[p[1]] == '\0' ? 2 + byte_words(p[1]) : 0;
+    break;
+  // A builder's capacity starts at STRBUF_INIT and only doubles when its length outgrows it
+  case LOBJ_STRBUF:
+    n = p[2] < 8 * (avail - 3) && p[2] <= p[1] && p[1] > 0 && p[1] <= 2 * (p[2] > STRBUF_INIT ? p[2] : STRBUF_INIT)
+      ? 3 + byte_words(p[2]) : 0;
+    break;
+  default:
+    return 0;
+  }
+
+  return n <= avail ? n : 0;
+}
+
+// The references in the record at p: sets *refs to the first and returns how many
+static size_t record_refs(uint64_t * p, uint64_t ** refs) {
+  switch (p[0]) {
+  case LOBJ_CONS:  *refs = p + 1; return 2;
+  case LOBJ_PROC:  *refs = p + 4; return 3;
+  case LOBJ_FRAME: *refs = p + 2; return 1 + p[1];
+  case LOBJ_LREF:  *refs = p + 3; return 1;
+  case LOBJ_VEC:   *refs = p + 2; return p[1];
+  default:         return 0;
+  }
+}
+
+static int ref_ok(uint64_t word, uint64_t nobjs) {
+  lobj_t * x = (lobj_t*)word;
+
+  if (isptr(x)) return word != 0 && (word >> 2) <= nobjs;
+  return isfixnum(x) || x == NIL || x == TRUE || x == UNBOUND;
+}
+
+// Check every record and reference, so image_load can trust the image
+static char * image_check() {
+  uint64_t nglobals = IMAGE[2], nobjs = IMAGE[3], * globals = IMAGE + IMAGE_HEADER;
+  uint64_t * p, * end = IMAGE + IMAGE_LEN, * refs;
+  unsigned char * types;
+  size_t n = 0, k;
+  int ok = 1;
+
+  if (IMAGE[0] != IMAGE_MAGIC) return "not a heap image";
+  if (IMAGE[1] != prim_signature()) return "the image was saved by a build with other primitives";
+  if (nglobals > (IMAGE_LEN - IMAGE_HEADER) / 2 || nobjs > STACKSIZE) return "corrupt image";
+
+  types = malloc(nobjs + 1);
+  p = globals + 2 * nglobals;
+
+  for (size_t i = 0; ok && i < nobjs; i++, p += n) {
+    n = record_size(p, end - p);
+    ok = n > 0;
+    if (!ok) break;
+
+    types[i] = p[0];
+    k = record_refs(p, &refs);
+    for (size_t j = 0; j < k; j++) ok &= ref_ok(refs[j], nobjs);
+  }
+
+  ok &= p == end;
+
+  for (size_t i = 0; ok && i < nglobals; i++) {
+    ok = isptr((lobj_t*)globals[2 * i]) && ref_ok(globals[2 * i], nobjs) &&
+         types[(globals[2 * i] >> 2) - 1] == LOBJ_SYM && ref_ok(globals[2 * i + 1], nobjs);
+  }
+
+  free(types);
+  return ok ? NULL : "corrupt image";
+}
+
+// Map and check the image in fname. Returns NULL, or why it can't be used.
+char * image_open(char * fname) {
+  struct stat st;
+  char * err;
+  int fd = open(fname, O_RDONLY);
+
+  if (fd < 0) return strerror(errno);
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < IMAGE_HEADER * 8 || st.st_size % 8 != 0) {
+    close(fd);
+    return "not a heap image";
+  }
+
+  IMAGE = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (IMAGE == MAP_FAILED) {
+    IMAGE = NULL;
+    return strerror(errno);
+  }
+
+  IMAGE_LEN = st.st_size / 8;
+  err = image_check();
+
+  if (err != NULL) {
+    munmap(IMAGE, IMAGE_LEN * 8);
+    IMAGE = NULL;
+  }
+
+  return err;
+}
+
+// The object a reference refers to, once the objects are on STACK from base
+#define image_obj(word, base) \
+  (isptr((lobj_t*)(word)) ? STACK[(base) + ((word) >> 2) - 1] : (lobj_t*)(word))
+
+// Allocate the object for the record at p, with its references left nil. Everything in
+// an image lives as long as the globals do, so it goes straight to the old space instead
+// of being copied out of the nursery by the next minor collections.
+static lobj_t * image_alloc(uint64_t * p) {
+  lobj_t * x;
+
+  switch (p[0]) {
+  case LOBJ_CONS:
+    x = lobj_alloc_old(LOBJ_CONS, sizeof(cons_t));
+    ((cons_t*)x)->_car = ((cons_t*)x)->_cdr = NIL;
+    return x;
+  case LOBJ_PROC:
+    x = lobj_alloc_old(LOBJ_PROC, sizeof(lambda_t));
+    toproc(x)->argc = p[1];
+    toproc(x)->vararg = p[2];
+    toproc(x)->evaltype = p[3];
+    toproc(x)->formals = toproc(x)->body = toproc(x)->env = toproc(x)->code = NIL;
+    return x;
+  case LOBJ_FRAME:
+    x = lobj_alloc_old(LOBJ_FRAME, sizeof(frame_t) + p[1] * sizeof(lobj_t*));
+    toframe(x)->parent = NIL;
+    toframe(x)->size = p[1];
+    for (uint64_t i = 0; i < p[1]; i++) toframe(x)->slots[i] = NIL;
+    return x;
+  case LOBJ_LREF:
+    x = lobj_alloc_old(LOBJ_LREF, sizeof(lref_t));
+    tolref(x)->depth = p[1];
+    tolref(x)->slot = p[2];
+    tolref(x)->name = NIL;
+    return x;
+  case LOBJ_VEC:
+    x = lobj_alloc_old(LOBJ_VEC, sizeof(vec_t) + p[1] * sizeof(lobj_t*));
+    tovec(x)->len = p[1];
+    for (uint64_t i = 0; i < p[1]; i++) tovec(x)->items[i] = NIL;
+    return x;
+  case LOBJ_NUM:   return new_num((long)p[1]);
+  case LOBJ_SYM:   return new_symn((char*)(p + 2), p[1]);
+  case LOBJ_STR:   return new_strn((char*)(p + 2), p[1]);
+  case LOBJ_ERR:   return new_err("%s", (char*)(p + 2));
+  case LOBJ_PRIM:
+    if (p[1] == (uint64_t)NPRIMITIVES) return CLOSURE;
+    if (p[1] == (uint64_t)NPRIMITIVES + 1) return CONSTANT;
+    return new_prim(PRIMITIVES[p[1]].body, p[2], p[3], p[4]);
+  case LOBJ_ARR:
+    x = new_arr(p[1]);
+    memcpy(toarr(x)->items, p + 2, p[1] * sizeof(int64_t));
+    return x;
+  default:
+    x = new_strbuf(p[1]);
+    memcpy(tostrbuf(x)->chars, p + 3, p[2]);
+    tostrbuf(x)->len = p[2];
+    return x;
+  }
+}
+
+static void image_set(lobj_t * obj, lobj_t ** field, lobj_t * value) {
+  write_barrier(obj, value);
+  *field = value;
+}
+
+// Fill in the references of x from the record at p
+static void image_fill(uint64_t * p, lobj_t * x, size_t base) {
+  switch (p[0]) {
+  case LOBJ_CONS:
+    fsetcar(x, image_obj(p[1], base));
+    fsetcdr(x, image_obj(p[2], base));
+    break;
+  case LOBJ_PROC:
+    image_set(x, &toproc(x)->formals, image_obj(p[4], base));
+    image_set(x, &toproc(x)->body, image_obj(p[5], base));
+    image_set(x, &toproc(x)->env, image_obj(p[6], base));
+    break;
+  case LOBJ_FRAME:
+    image_set(x, &toframe(x)->parent, image_obj(p[2], base));
+    for (uint64_t i = 0; i < p[1]; i++) image_set(x, &toframe(x)->slots[i], image_obj(p[3 + i], base));
+    break;
+  case LOBJ_LREF:
+    image_set(x, &tolref(x)->name, image_obj(p[3], base));
+    break;
+  case LOBJ_VEC:
+    for (uint64_t i = 0; i < p[1]; i++) image_set(x, &tovec(x)->items[i], image_obj(p[2 + i], base));
+    break;
+  }
+}
+
+// Build the global environment from the image, if one was opened. Returns 0 if not.
+int image_load() {
+  uint64_t * globals, * records, * end, * p;
+  size_t base = SP, i;
+  lobj_t * x;
+
+  if (IMAGE == NULL) return 0;
+
+  globals = IMAGE + IMAGE_HEADER;
+  records = globals + 2 * IMAGE[2];
+  end = IMAGE + IMAGE_LEN;
+
+  // All of it is live, so don't start a collection to find that out. STACK holds what
+  // has been allocated so far in case one runs anyway.
+  if (GC_THRESHOLD < 2 * (ALLOCATIONS + (int)IMAGE[3])) GC_THRESHOLD = 2 * (ALLOCATIONS + (int)IMAGE[3]);
+
+  for (p = records; p < end; p += record_size(p, end - p)) {
+    x = image_alloc(p);
+    push(x);
+  }
+
+  i = 0;
+  for (p = records; p < end; p += record_size(p, end - p)) image_fill(p, STACK[base + i++], base);
+
+  for (i = 0; i < IMAGE[2]; i++) {
+    global_def(image_obj(globals[2 * i], base), image_obj(globals[2 * i + 1], base));
+  }
+
+  SP = base;
+  return 1;
+}
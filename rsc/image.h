@@ -0,0 +1,48 @@
+#ifndef image_h
+#define image_h
+#include "rascal.h"
+#include "object.h"
+
+/*
+
+Heap images
+
+(save-image "std.img") writes the global environment, and everything reachable from it,
+to a file; rascal --image std.img starts from that file instead of binding the
+primitives and loading prelude.rsp. The image is an array of 64-bit words: a header,
+a (name, value) pair for each global, then one record per object. A record is the
+object's type followed by its scalar fields and its references. A reference is either
+the value itself (fixnums, nil, t, undef) or the object's number shifted left two bits,
+so it can never be mistaken for either. Primitives are stored as their index in
+PRIMITIVES, whose names and arities are hashed into the header, so an image is only
+accepted by a build with the same primitives.
+
+Code objects are not saved: a lambda is compiled again the first time it is called.
+A string slice is saved as a string of its own.
+
+The image is mapped once, checked, and kept for the life of the process. Every
+interpreter started after it is opened (the pool's workers included) is built from it,
+in two passes: one allocates each object, the other fills in its references.
+
+*/
+
+#define IMAGE_MAGIC 0x31304d4943534152UL   // "RASCIM01"
+#define IMAGE_HEADER 4
+
+// An entry in PRIMITIVES (see rascal.c)
+typedef struct _primdef_t {
+  char * name;
+  proc_t body;
+  int argc;
+  int evaltype;
+} primdef_t;
+
+extern primdef_t PRIMITIVES[];
+extern const int NPRIMITIVES;
+
+/* Forward declarations */
+char * image_open(char *);
+int image_load();
+lobj_t * prim_save_image(lobj_t * args[1], lobj_t **);
+
+#endif
@@ -2,11 +2,12 @@
 #include "eval.h"
 #include "printer.h"
 #include "util.h"
+#include "alloc.h"
 
 cons_t * mk_cons(lobj_t * car_, lobj_t * cdr_) {
-  cons_t * v = malloc(sizeof(cons_t));
-  v->type = LOBJ_CONS;
-  v->tag = GC_WHITE;
+  preserve(&car_, &cdr_);
+  cons_t * v = (cons_t*)lobj_alloc(LOBJ_CONS, sizeof(cons_t));
+  release(2);
   v->_car = car_;
   v->_cdr = cdr_;
 
@@ -14,96 +15,204 @@ cons_t * mk_cons(lobj_t * car_, lobj_t * cdr_) {
 }
 
 lobj_t * new_cons(lobj_t * car_, lobj_t * cdr_) {
-  lobj_t * out = LOBJ_CAST(mk_cons(car_, cdr_));
-  LINK(out);
+  return LOBJ_CAST(mk_cons(car_, cdr_));
+}
 
-  return out;
+/*
+Symbol table. Open addressing with linear probing; the capacity is always a power of two
+and the table is kept at most half full. The table does not keep symbols alive: symtab_sweep
+drops unmarked symbols before the collector frees them.
+ */
+static sym_t ** symtab_slot(sym_t ** table, size_t cap, char * name, long len, uint64_t hash) {
+  size_t mask = cap - 1, i = hash & mask;
+
+  for (; table[i] != NULL; i = (i + 1) & mask) {
+    if (table[i]->hash == hash && strncmp(table[i]->name, name, len) == 0 && table[i]->name[len] == '\0') break;
+  }
+
+  return &table[i];
 }
 
-sym_t * mk_sym(char * name) {
-  sym_t * s = malloc(sizeof(sym_t));
-  s->type = LOBJ_SYM;
-  s->tag = GC_WHITE;
-  str_init(s->name, name);
+static void symtab_resize(size_t cap) {
+  sym_t ** old = SYMTAB;
+  size_t oldcap = SYMTAB_CAP;
+
+  SYMTAB = calloc(cap, sizeof(sym_t*));
+  SYMTAB_CAP = cap;
+
+  for (size_t i = 0; i < oldcap; i++) {
+    if (old[i] != NULL) *symtab_slot(SYMTAB, cap, old[i]->name, strlen(old[i]->name), old[i]->hash) = old[i];
+  }
+
+  free(old);
+}
+
+// Empty slot i, moving later entries of its cluster back so none is left behind a gap
+static void symtab_delete(size_t i) {
+  size_t mask = SYMTAB_CAP - 1, j = (i + 1) & mask, home;
+
+  for (; SYMTAB[j] != NULL; j = (j + 1) & mask) {
+    home = SYMTAB[j]->hash & mask;
+    // SYMTAB[j] can fill the gap unless its home slot lies after the gap (cyclically)
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      SYMTAB[i] = SYMTAB[j];
+      i = j;
+    }
+  }
+
+  SYMTAB[i] = NULL;
+  SYMTAB_COUNT--;
+}
+
+/*
+Drop unreachable symbols from the table. Called by the collector after marking. Entries
+are deleted in place, starting after an empty slot so no cluster wraps past the start of
+the scan; an entry moved into the slot just emptied is checked before moving on. The
+table is only rebuilt if it has become mostly empty.
+*/
+void symtab_sweep() {
+  size_t mask, start, i, n;
+
+  if (SYMTAB == NULL) return;
+
+  mask = SYMTAB_CAP - 1;
+  for (start = 0; SYMTAB[start] != NULL; start++);
+
+  for (n = 0, i = (start + 1) & mask; n < SYMTAB_CAP; ) {
+    if (SYMTAB[i] != NULL && GC_COLOR(SYMTAB[i]) == GC_WHITE) {
+      symtab_delete(i);
+    } else {
+      i = (i + 1) & mask;
+      n++;
+    }
+  }
+
+  if (SYMTAB_CAP > SYMTAB_INIT_CAP && 8 * SYMTAB_COUNT < SYMTAB_CAP) {
+    for (n = SYMTAB_CAP; n > SYMTAB_INIT_CAP && 8 * SYMTAB_COUNT < n; n /= 2);
+    symtab_resize(n);
+  }
+}
+
+// A symbol named by the len bytes at name, which need not be null-terminated
+sym_t * mk_symn(char * name, long len) {
+  if (SYMTAB == NULL) {
+    SYMTAB = calloc(SYMTAB_INIT_CAP, sizeof(sym_t*));
+    SYMTAB_CAP = SYMTAB_INIT_CAP;
+  }
+
+  if (2 * (SYMTAB_COUNT + 1) > SYMTAB_CAP) symtab_resize(2 * SYMTAB_CAP);
+
+  sym_t * s = (sym_t*)lobj_alloc(LOBJ_SYM, sizeof(sym_t));
+  s->hash = hash_mem(name, len);
+  s->name = malloc(len + 1);
+  memcpy(s->name, name, len);
+  s->name[len] = '\0';
+  *symtab_slot(SYMTAB, SYMTAB_CAP, name, len, s->hash) = s;
+  SYMTAB_COUNT++;
 
   return s;
 }
 
-lobj_t * new_sym(char * name) {
-  lobj_t * out = LOBJ_CAST(mk_sym(name));
- LINK(out);
+sym_t * mk_sym(char * name) {
+  return mk_symn(name, strlen(name));
+}
 
-  return out;
+// Return the interned symbol with this name, creating it if necessary
+lobj_t * new_symn(char * name, long len) {
+  if (SYMTAB != NULL) {
+    sym_t * s = *symtab_slot(SYMTAB, SYMTAB_CAP, name, len, hash_mem(name, len));
+    if (s != NULL) return LOBJ_CAST(s);
+  }
+
+  return LOBJ_CAST(mk_symn(name, len));
 }
 
-str_t * mk_str(char * value) {
-  str_t * s = malloc(sizeof(str_t));
-  s->type = LOBJ_STR;
-  s->tag = GC_WHITE;
-  str_init(s->value, value);
+lobj_t * new_sym(char * name) {
+  return new_symn(name, strlen(name));
+}
+
+// A string owning a copy of the len bytes at chars
+str_t * mk_strn(char * chars, long len) {
+  str_t * s = (str_t*)lobj_alloc(LOBJ_STR, sizeof(str_t));
+  s->len = len;
+  s->hash = 0;
+  s->chars = malloc(len + 1);
+  s->base = NIL;
+  memcpy(s->chars, chars, len);
+  s->chars[len] = '\0';
 
   return s;
 }
 
+lobj_t * new_strn(char * chars, long len) {
+  return LOBJ_CAST(mk_strn(chars, len));
+}
+
+str_t * mk_str(char * value) {
+  return mk_strn(value, strlen(value));
+}
+
 lobj_t * new_str(char * value) {
-  lobj_t * out = LOBJ_CAST(mk_str(value));
-  LINK(out);
+  return LOBJ_CAST(mk_str(value));
+}
 
-  return out;
+strbuf_t * mk_strbuf(long cap) {
+  strbuf_t * b = (strbuf_t*)lobj_alloc(LOBJ_STRBUF, sizeof(strbuf_t));
+  b->len = 0;
+  b->cap = cap > 0 ? cap : STRBUF_INIT;
+  b->chars = malloc(b->cap);
+
+  return b;
+}
+
+lobj_t * new_strbuf(long cap) {
+  return LOBJ_CAST(mk_strbuf(cap));
 }
 
 num_t * mk_num(long value) {
-  num_t * n = malloc(sizeof(num_t));
-  n->tag = GC_WHITE;
-  n->type = LOBJ_NUM;
+  num_t * n = (num_t*)lobj_alloc(LOBJ_NUM, sizeof(num_t));
   n->value = value;
 
   return n;
 }
 
+// Small integers are returned as fixnums; only values outside the fixnum range are boxed
 lobj_t * new_num(long value) {
-    lobj_t * out = LOBJ_CAST(mk_num(value));
-  LINK(out);
+  if (value >= FIXNUM_MIN && value <= FIXNUM_MAX) return fixnum(value);
 
-  return out;
+  return LOBJ_CAST(mk_num(value));
 }
 
-err_t * mk_err(char * fmt, ...) {
-  err_t * v = malloc(sizeof(err_t));
-  v->tag = GC_WHITE;
-  v->type = LOBJ_ERR;
+static err_t * mk_verr(char * fmt, va_list va) {
+  err_t * v = (err_t*)lobj_alloc(LOBJ_ERR, sizeof(err_t));
 
-  va_list va;
-  va_start(va, fmt);
   v-> msg = malloc(512);
   vsnprintf(v->msg, 511, fmt, va);
   v->msg = realloc(v->msg, strlen(v->msg)+1);
+
+  return v;
+}
+
+err_t * mk_err(char * fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  err_t * v = mk_verr(fmt, va);
   va_end(va);
 
   return v;
 }
 
 lobj_t * new_err(char * fmt, ...) {
-  err_t * v = malloc(sizeof(err_t));
-  v->tag = GC_WHITE;
-  v->type = LOBJ_ERR;
-
   va_list va;
   va_start(va, fmt);
-  v-> msg = malloc(512);
-  vsnprintf(v->msg, 511, fmt, va);
-  v->msg = realloc(v->msg, strlen(v->msg)+1);
+  lobj_t * out = LOBJ_CAST(mk_verr(fmt, va));
   va_end(va);
 
-  lobj_t * out = LOBJ_CAST(v);
-  LINK(out);
   return out;
 }
 
 prim_t * mk_prim(proc_t body, int argc, int vararg, int evaltype) {
-  prim_t * fun = malloc(sizeof(prim_t));
-  fun->type = LOBJ_PRIM;
-  fun->tag = GC_WHITE;
+  prim_t * fun = (prim_t*)lobj_alloc(LOBJ_PRIM, sizeof(prim_t));
   fun->argc = argc;
   fun->vararg = vararg;
   fun->evaltype = evaltype;
@@ -113,51 +222,150 @@ prim_t * mk_prim(proc_t body, int argc, int vararg, int evaltype) {
 }
 
 lobj_t * new_prim(proc_t body, int argc, int vararg, int evaltype) {
-  lobj_t * fun = LOBJ_CAST(mk_prim(body, argc, vararg, evaltype));
-  LINK(fun);
-
-  return fun;
+  return LOBJ_CAST(mk_prim(body, argc, vararg, evaltype));
 }
 
 
 
-lambda_t * mk_proc(lobj_t * formals, lobj_t * body, lobj_t ** parent, int vararg, int evaltype) {
-  lambda_t * fun = malloc(sizeof(lambda_t));
-  fun->type = LOBJ_PROC;
-  fun->tag = GC_WHITE;
+lambda_t * mk_proc(lobj_t * formals, lobj_t * body, lobj_t * parent, int vararg, int evaltype) {
+  preserve(&formals, &body, &parent);
+  lambda_t * fun = (lambda_t*)lobj_alloc(LOBJ_PROC, sizeof(lambda_t));
+  release(3);
   fun->argc = list_len(formals);
   fun->vararg = vararg;
   fun->evaltype = evaltype;
   fun->formals = formals;
   fun->body = body;
   fun->env = parent;
+  fun->code = NIL;
 
   return fun;
 }
 
-lobj_t * new_proc(lobj_t * formals, lobj_t * body, lobj_t ** parent, int vararg, int evaltype) {
-  lobj_t * out = LOBJ_CAST(mk_proc(formals, body, parent, vararg, evaltype));
-  LINK(out);
+lobj_t * new_proc(lobj_t * formals, lobj_t * body, lobj_t * parent, int vararg, int evaltype) {
+  return LOBJ_CAST(mk_proc(formals, body, parent, vararg, evaltype));
+}
+
+frame_t * mk_frame(lobj_t * parent, int size) {
+  preserve(&parent);
+  frame_t * f = (frame_t*)lobj_alloc(LOBJ_FRAME, sizeof(frame_t) + size * sizeof(lobj_t*));
+  release(1);
+  f->parent = parent;
+  f->size = size;
+
+  for (int i = 0; i < size; i++) f->slots[i] = NIL;
+
+  return f;
+}
+
+lobj_t * new_frame(lobj_t * parent, int size) {
+  return LOBJ_CAST(mk_frame(parent, size));
+}
+
+lref_t * mk_lref(lobj_t * name, int depth, int slot) {
+  preserve(&name);
+  lref_t * r = (lref_t*)lobj_alloc(LOBJ_LREF, sizeof(lref_t));
+  release(1);
+  r->name = name;
+  r->depth = depth;
+  r->slot = slot;
+
+  return r;
+}
+
+lobj_t * new_lref(lobj_t * name, int depth, int slot) {
+  return LOBJ_CAST(mk_lref(name, depth, slot));
+}
+
+// Build a code object from instrs (which it takes ownership of) and a list of constants
+// in reverse order
+code_t * mk_code(int32_t * instrs, int ninstrs, lobj_t * consts, int nconsts, int ncaches) {
+  preserve(&consts);
+  code_t * c = (code_t*)lobj_alloc(LOBJ_CODE, sizeof(code_t) + nconsts * sizeof(lobj_t*));
+  release(1);
+  c->instrs = instrs;
+  c->ninstrs = ninstrs;
+  c->caches = calloc(ncaches > 0 ? ncaches : 1, sizeof(icache_t));
+  c->nconsts = nconsts;
+
+  for (int i = nconsts - 1; i >= 0; i--, consts = cdr(consts)) {
+    write_barrier(LOBJ_CAST(c), car(consts));
+    c->consts[i] = car(consts);
+  }
+
+  return c;
+}
+
+// A vector of len elements, each set to fill
+vec_t * mk_vec(long len, lobj_t * fill) {
+  LASSERT(len >= 0 && len <= VEC_MAX, "Value Error: bad vector length %li", len)
+  preserve(&fill);
+  vec_t * v = (vec_t*)lobj_alloc(LOBJ_VEC, sizeof(vec_t) + len * sizeof(lobj_t*));
+  release(1);
+  v->len = len;
+
+  for (long i = 0; i < len; i++) v->items[i] = fill;
+
+  return v;
+}
+
+lobj_t * new_vec(long len, lobj_t * fill) {
+  return LOBJ_CAST(mk_vec(len, fill));
+}
+
+lobj_t * list_to_vec(lobj_t * xs) {
+  lobj_t * out;
+  long len = list_len(xs);
+
+  preserve(&xs);
+  out = new_vec(len, NIL);
+  release(1);
+
+  // Nothing allocates while the new vector is filled, so the stores need no barrier
+  for (long i = 0; i < len; i++, xs = cdr(xs)) tovec(out)->items[i] = car(xs);
 
   return out;
 }
 
+// A typed array of len items. The items are not initialized.
+arr_t * mk_arr(long len) {
+  LASSERT(len >= 0 && len <= ARR_MAX, "Value Error: bad array length %li", len)
+  arr_t * a = (arr_t*)lobj_alloc(LOBJ_ARR, sizeof(arr_t) + len * sizeof(int64_t));
+  a->len = len;
+
+  return a;
+}
+
+lobj_t * new_arr(long len) {
+  return LOBJ_CAST(mk_arr(len));
+}
 
 // Safecast macro (credit Jeff Bezanson, author of FemtoLisp)
 #define SAFECAST_OP(ctype,ltype,name)				     \
   ctype to##ltype(lobj_t * v)                                        \
   {                                                                  \
-    LASSERT(is##ltype(v), "Expected type %s, got %d", name, v->type) \
+    LASSERT(is##ltype(v), "Expected type %s, got %d", name, lobj_type(v)) \
     return (ctype)v;                                                 \
   }
 
 SAFECAST_OP(cons_t*, cons, "cons")
-SAFECAST_OP(num_t*, num, "num")
 SAFECAST_OP(err_t*, err, "err")
 SAFECAST_OP(sym_t*, sym, "sym")
 SAFECAST_OP(lambda_t*, proc, "proc")
 SAFECAST_OP(prim_t*, prim, "prim")
 SAFECAST_OP(str_t*, string, "string")
+SAFECAST_OP(frame_t*, frame, "frame")
+SAFECAST_OP(lref_t*, lref, "lref")
+SAFECAST_OP(code_t*, code, "code")
+SAFECAST_OP(vec_t*, vec, "vec")
+SAFECAST_OP(arr_t*, arr, "arr")
+SAFECAST_OP(strbuf_t*, strbuf, "strbuf")
+
+long tonum(lobj_t * v) {
+  LASSERT(isnum(v), "Expected type num, got %d", lobj_type(v))
+
+  return isfixnum(v) ? fixnum_val(v) : ((num_t*)v)->value;
+}
 
 // Deep copy operation
 // Carefully consider whether copying an object means copying an environment!
@@ -165,190 +373,246 @@ SAFECAST_OP(str_t*, string, "string")
   LASSERT(obj != NULL, "Attempt to access illegal memory.")
   lobj_t * out;
     
-    switch (obj->type) {
-    case LOBJ_NUM: return new_num(tonum(obj)->value);
+    switch (lobj_type(obj)) {
+    case LOBJ_NUM:
+    case LOBJ_CONST: return obj;
     case LOBJ_ERR: return new_err(toerr(obj)->msg);
     case LOBJ_SYM: return new_sym(tosym(obj)->name);
-    case LOBJ_STR: return new_str(tostring(obj)->value);
+    case LOBJ_STR: return new_strn(tostring(obj)->chars, tostring(obj)->len);
     case LOBJ_PROC:{
-       lambda_t * proc = toproc(obj);
-       lambda_t * out_proc = mk_proc(lobj_copy(proc->formals), lobj_copy(proc->body), proc->env, proc->vararg, proc->evaltype);
-       out = LOBJ_CAST(out_proc);
+       lobj_t * formals = NIL, * body;
+       preserve(&obj, &formals);
+       formals = lobj_copy(toproc(obj)->formals);
+       body = lobj_copy(toproc(obj)->body);
+       out = new_proc(formals, body, toproc(obj)->env, toproc(obj)->vararg, toproc(obj)->evaltype);
+       release(2);
        break;
      }case LOBJ_PRIM: return obj;
-      case LOBJ_CONS: return new_cons(lobj_copy(car(obj)), lobj_copy(cdr(obj)));
+      case LOBJ_CONS:{
+       lobj_t * head = NIL;
+       preserve(&obj, &head);
+       head = lobj_copy(car(obj));
+       out = new_cons(head, lobj_copy(cdr(obj)));
+       release(2);
+       break;
+     }
+      case LOBJ_VEC:{
+       lobj_t * item = NIL;
+       out = NIL;
+       preserve(&obj, &item, &out);
+       out = new_vec(tovec(obj)->len, NIL);
+       for (long i = 0; i < tovec(obj)->len; i++) {
+         item = lobj_copy(tovec(obj)->items[i]);
+         write_barrier(out, item);
+         tovec(out)->items[i] = item;
+       }
+       release(3);
+       break;
+     }
+      case LOBJ_STRBUF:
+       preserve(&obj);
+       out = new_strbuf(tostrbuf(obj)->cap);
+       release(1);
+       memcpy(tostrbuf(out)->chars, tostrbuf(obj)->chars, tostrbuf(obj)->len);
+       tostrbuf(out)->len = tostrbuf(obj)->len;
+       break;
+      case LOBJ_ARR:
+       preserve(&obj);
+       out = new_arr(toarr(obj)->len);
+       release(1);
+       memcpy(toarr(out)->items, toarr(obj)->items, toarr(obj)->len * sizeof(int64_t));
+       break;
+      case LOBJ_FRAME:
+      case LOBJ_LREF: return obj;
     } 
 
     return out;
 }
 
-// Helpers for working with symbols. For now environments are implemented as sorted lists,
-// due to ease of implementation and debugging. This will be upgraded once a stable version
-// of the language exists.
+// Helpers for working with symbols. Local variables are resolved to frame slots when a
+// lambda is created (see resolve in eval.c), so symbols that reach the evaluator name
+// globals, which live in the GLOBALS hash table.
 
-lobj_t * assoc(lobj_t * value, lobj_t ** env) {
-  if (isnil(env)) return UNBOUND;
+static gbind_t ** globals_slot(gbind_t ** table, size_t cap, lobj_t * name) {
+  size_t mask = cap - 1, i = tosym(name)->hash & mask;
 
-  int cmp = cmpsym(value, car(car(*env)));
+  for (; table[i] != NULL; i = (i + 1) & mask) {
+    if (table[i]->name == name) break;
+  }
+
+  return &table[i];
+}
+
+static void globals_resize(size_t cap) {
+  gbind_t ** old = GLOBALS;
+  size_t oldcap = GLOBALS_CAP;
+
+  GLOBALS = calloc(cap, sizeof(gbind_t*));
+  GLOBALS_CAP = cap;
+
+  for (size_t i = 0; i < oldcap; i++) {
+    if (old[i] != NULL) *globals_slot(GLOBALS, cap, old[i]->name) = old[i];
+  }
+
+  free(old);
+}
 
-  if (cmp < 0) return assoc(value, &(cdr(*env)));
+// Return the global binding for name, or NULL if it has never been defined
+gbind_t * global_ref(lobj_t * name) {
+  if (GLOBALS == NULL) return NULL;
 
-  if (cmp > 0) return UNBOUND;
-  
-  return car(*env);  
+  return *globals_slot(GLOBALS, GLOBALS_CAP, name);
 }
 
+// Bind name in the global environment, replacing any previous value
+gbind_t * global_def(lobj_t * name, lobj_t * value) {
+  if (GLOBALS == NULL) {
+    GLOBALS = calloc(GLOBALS_INIT_CAP, sizeof(gbind_t*));
+    GLOBALS_CAP = GLOBALS_INIT_CAP;
+  }
 
-lobj_t * intern(lobj_t * new, lobj_t ** env, lobj_t * value) {
-  if (isnil(env)) return new_cons(new_cons(new, value), *env);
+  if (2 * (GLOBALS_COUNT + 1) > GLOBALS_CAP) globals_resize(2 * GLOBALS_CAP);
 
-  int cmp = cmpsym(new, car(car(*env)));
+  gbind_t ** slot = globals_slot(GLOBALS, GLOBALS_CAP, name);
 
-  if (cmp < 0) return new_cons(car(*env), intern(new, &(cdr(*env)), value));
+  if (*slot == NULL) {
+    *slot = malloc(sizeof(gbind_t));
+    (*slot)->name = name;
+    (*slot)->remembered = 0;
+    (*slot)->version = 0;
+    GLOBALS_COUNT++;
+    if (GC_STATE == GC_MARKING) grey(name);
+  }
 
-  return new_cons(new_cons(new, value), *env);
-  
+  global_set(*slot, value);
+  return *slot;
 }
 
-void update(lobj_t * key, lobj_t ** env, lobj_t * value) {
-  lobj_t * pair = assoc(key, env);
+void global_set(gbind_t * binding, lobj_t * value) {
+  global_barrier(binding, value);
+  binding->value = value;
+  if (++binding->version == 0) binding->version = 1;
+}
 
-  if (isunbound(pair)) return;
+// Return the address of a slot in the frame depth levels above frame
+lobj_t ** frame_slot(lobj_t * frame, int depth, int slot) {
+  for (; depth > 0; depth--) frame = toframe(frame)->parent;
 
-  setcdr(pair, value);
+  return &(toframe(frame)->slots[slot]);
+}
+
+void update(lobj_t * key, lobj_t ** env, lobj_t * value) {
+  gbind_t * binding = global_ref(key);
+
+  if (binding != NULL) global_set(binding, value);
 }
 
 lobj_t * lookup(lobj_t * sym, lobj_t ** env) {
-  lobj_t * pair = assoc(sym, env);
-  if (isunbound(pair)) return UNBOUND;
+  gbind_t * binding = global_ref(sym);
 
-  return cdr(pair);
+  return binding == NULL ? UNBOUND : binding->value;
 }
 
-// Imperatively update environment with new key
+// Imperatively update environment with new key. Frames have a fixed layout, so every
+// definition goes into the global table.
 void puts_env(lobj_t * key, lobj_t ** env, lobj_t * binding) {
-  lobj_t ** prev = NULL, ** curr = env;
-  int cmp;
-  lobj_t * new_value = new_cons(key, binding);
+  global_def(key, binding);
+} 
 
-  if (isnil(*env)) { *env = new_cons(new_value, *env); }
 
-  while (!isnil(*curr)) {
-    cmp = cmpsym(key, car(car(*curr)));
+// Primitive operations and functions
+/*
+Checked arithmetic, shared by the primitives, the VM's arithmetic opcodes and constant
+folding. num_op returns 0 instead of a result that doesn't fit in a long (x86 traps on
+LONG_MIN / -1 as well); the divisor must be nonzero and the exponent non-negative.
+*/
+int num_op(int op, long x, long y, long * out) {
+  long acc = 1;
 
-    if (cmp == 0) return;
-    
-    if (cmp > 0) break;
+  switch (op) {
+  case NUM_ADD: return !__builtin_add_overflow(x, y, out);
+  case NUM_SUB: return !__builtin_sub_overflow(x, y, out);
+  case NUM_MUL: return !__builtin_mul_overflow(x, y, out);
+  case NUM_DIV:
+    if (x == LONG_MIN && y == -1) return 0;
+    *out = x / y;
+    return 1;
+  case NUM_MOD:
+    *out = y == -1 ? 0 : x % y;
+    return 1;
+  }
 
-    prev = curr;
-    curr = &cdr(*curr);
+  // x is squared only while the remaining exponent needs it, so an overflow is a real one
+  while (y) {
+    if (y % 2) {
+      y -= 1;
+      if (__builtin_mul_overflow(acc, x, &acc)) return 0;
+    } else {
+      y >>= 1;
+      if (__builtin_mul_overflow(x, x, &x)) return 0;
     }
+  }
 
-  lobj_t * new_env = new_cons(new_value, *curr);
+  *out = acc;
+  return 1;
+}
 
-  // Empty environment or new maximal elements special case
-  if (prev == NULL) {
-    *env = new_env;
-    
-  } else { setcdr(*prev, new_env);  }
-  return;
-} 
+long num_arith(int op, long x, long y) {
+  long out;
 
+  LASSERT(!(op == NUM_DIV && y == 0), "Divide by Zero Error.")
+  LASSERT(!(op == NUM_MOD && y == 0), "Modulo by Zero Error.")
+  LASSERT(!(op == NUM_POW && y < 0), "Negative exponent.")
+  LASSERT(num_op(op, x, y, &out), "Integer overflow.")
+
+  return out;
+}
 
-// Primitive operations and functions
 lobj_t * prim_add(lobj_t * args[2], lobj_t ** env) {
-  num_t * x = tonum(lobj_eval(args[0], env));
-  num_t * y = tonum(lobj_eval(args[1], env));
+  return new_num(num_arith(NUM_ADD, tonum(args[0]), tonum(args[1])));
+}
+
+lobj_t * lobj_eq(lobj_t * x, lobj_t * y) {
+  if (isnum(x) && isnum(y)) return tonum(x) == tonum(y) ? TRUE : NIL;
 
-  return new_num(x->value + y->value);
+  // Symbols are interned and constants are immediate, so both compare by address
+  return x == y && (issym(x) || isconst(x)) ? TRUE : NIL;
 }
 
 lobj_t * prim_eq(lobj_t * args[2], lobj_t ** env) {
-  lobj_t * x = lobj_eval(args[0], env);
-  lobj_t * y = lobj_eval(args[1], env);
-  lobj_t * out = NIL;
-
-  switch (x->type) {
-  case LOBJ_NUM:{
-    if (isnum(y) && (tonum(x)->value) == (tonum(y)->value)) {
-      out = new_sym("t");
-    }
-    break;
- }case LOBJ_SYM:{
-    if (issym(y) && fcmpsym(x,y) == 0) {
-      out = new_sym("t");
-    }
-    break;
-  }default: break;
- }
-
-  return out;
+  return lobj_eq(args[0], args[1]);
 }
 
 lobj_t * prim_sub(lobj_t * args[2], lobj_t ** env) {
-  num_t * x = tonum(lobj_eval(args[0], env));
-  num_t * y = tonum(lobj_eval(args[1], env));
-
-  return new_num(x->value - y->value);
+  return new_num(num_arith(NUM_SUB, tonum(args[0]), tonum(args[1])));
 }
 
 lobj_t * prim_mul(lobj_t * args[2], lobj_t ** env) {
-  num_t * x = tonum(lobj_eval(args[0], env));
-  num_t * y = tonum(lobj_eval(args[1], env));
-
-  return new_num(x->value * y->value);
+  return new_num(num_arith(NUM_MUL, tonum(args[0]), tonum(args[1])));
 }
 
 lobj_t * prim_div(lobj_t * args[2], lobj_t ** env) {
-  num_t * x = tonum(lobj_eval(args[0], env));
-  num_t * y = tonum(lobj_eval(args[1], env));
-
-  LASSERT(y->value != 0, "Divide by Zero Error.")
-
-  return new_num(x->value / y->value);
+  return new_num(num_arith(NUM_DIV, tonum(args[0]), tonum(args[1])));
 }
 
 lobj_t * prim_mod(lobj_t * args[2], lobj_t ** env) {
-  num_t * x = tonum(lobj_eval(args[0], env));
-  num_t * y = tonum(lobj_eval(args[1], env));
-  LASSERT(y->value != 0, "Modulo by Zero Error.")
-
-  return new_num(x->value % y->value);
+  return new_num(num_arith(NUM_MOD, tonum(args[0]), tonum(args[1])));
 }
 
 lobj_t * prim_pow(lobj_t * args[2], lobj_t ** env) {
-  long x = tonum(lobj_eval(args[0], env))->value;
-  long y = tonum(lobj_eval(args[1], env))->value;
-
-  long acc = 1;
-
-  while (y) {
-    if (y % 2) {
-      y -= 1;
-      acc *= x;
-    } else {
-      y >>= 1;
-      x *= x;
-    }
-  }
-
-  return new_num(acc);
-  
+  return new_num(num_arith(NUM_POW, tonum(args[0]), tonum(args[1])));
 }
 
 lobj_t * prim_cons(lobj_t * args[2], lobj_t ** env) {
-  lobj_t * thecar = lobj_eval(args[0], env);
-  lobj_t * thecdr = lobj_eval(args[1], env);
-
-  return new_cons(thecar, thecdr);
+  return new_cons(args[0], args[1]);
 }
 
 lobj_t * prim_head(lobj_t * args[1], lobj_t ** env) {
-  return car(lobj_eval(args[0], env));
+  return car(args[0]);
 }
 
 lobj_t * prim_tail(lobj_t * args[1], lobj_t ** env) {
-  return cdr(lobj_eval(args[0], env));
+  return cdr(args[0]);
 }
 
 lobj_t * prim_eval(lobj_t * args[2], lobj_t ** env) {
@@ -356,11 +620,22 @@ lobj_t * prim_eval(lobj_t * args[2], lobj_t ** env) {
 }
 
 lobj_t * prim_apply(lobj_t * args[3], lobj_t ** env) {
-  return apply(lobj_eval(args[0], env), &args[1], args[2]);
+  return apply_values(args[0], &args[1], args[2]);
 }
 
+// Return the global environment as an association list
 lobj_t * prim_globals(lobj_t ** args, lobj_t ** env) {
-  return LOBJ_CAST(GLOBALS);
+  lobj_t * out = NIL, * pair;
+  preserve(&out);
+
+  for (size_t i = 0; i < GLOBALS_CAP; i++) {
+    if (GLOBALS[i] == NULL) continue;
+    pair = new_cons(GLOBALS[i]->name, GLOBALS[i]->value);
+    out = new_cons(pair, out);
+  }
+
+  release(1);
+  return out;
 }
 
 // For debugging from the REPL
@@ -369,26 +644,96 @@ lobj_t * prim_allocations(lobj_t ** args, lobj_t ** env) {
   return NIL;
 }
 
+lobj_t * prim_heap_stats(lobj_t ** args, lobj_t ** env) {
+  show_heap_stats();
+  return NIL;
+}
+
 lobj_t * prim_print(lobj_t * args[1], lobj_t ** env) {
   lobj_println(args[0]);
   return NIL;
 
 }
 
+// Vectors
+static long vec_index(lobj_t * vec, lobj_t * i, long hi) {
+  long n = tonum(i);
+  LASSERT(n >= 0 && n < hi, "Index Error: %li out of range for vector of length %li", n, tovec(vec)->len)
+
+  return n;
+}
+
+lobj_t * prim_make_vec(lobj_t * args[2], lobj_t ** env) {
+  return new_vec(tonum(args[0]), args[1]);
+}
+
+lobj_t * prim_vec_ref(lobj_t * args[2], lobj_t ** env) {
+  return tovec(args[0])->items[vec_index(args[0], args[1], tovec(args[0])->len)];
+}
+
+lobj_t * prim_vec_set(lobj_t * args[3], lobj_t ** env) {
+  vec_t * v = tovec(args[0]);
+  long i = vec_index(args[0], args[1], v->len);
+
+  write_barrier(LOBJ_CAST(v), args[2]);
+  v->items[i] = args[2];
+  return args[2];
+}
+
+lobj_t * prim_vec_len(lobj_t * args[1], lobj_t ** env) {
+  return new_num(tovec(args[0])->len);
+}
+
+// The elements from start up to (not including) end, as a new vector
+lobj_t * prim_vec_slice(lobj_t * args[3], lobj_t ** env) {
+  lobj_t * vec = args[0], * out;
+  long end = vec_index(vec, args[2], tovec(vec)->len + 1);
+  long start = vec_index(vec, args[1], end + 1);
+
+  preserve(&vec);
+  out = new_vec(end - start, NIL);
+  release(1);
+  memcpy(tovec(out)->items, tovec(vec)->items + start, (end - start) * sizeof(lobj_t*));
+
+  return out;
+}
+
+lobj_t * prim_vec_to_list(lobj_t * args[1], lobj_t ** env) {
+  lobj_t * vec = args[0], * out = NIL;
+  preserve(&vec, &out);
+
+  for (long i = tovec(vec)->len; i-- > 0;) out = new_cons(tovec(vec)->items[i], out);
+
+  release(2);
+  return out;
+}
+
+lobj_t * prim_list_to_vec(lobj_t * args[1], lobj_t ** env) {
+  return list_to_vec(args[0]);
+}
+
 // Special forms
 lobj_t * form_def(lobj_t * args[2], lobj_t ** env) {
-  lobj_t * name = args[0];
   lobj_t * binding = lobj_eval(args[1], env);
-  puts_env(name, env, binding);
+  puts_env(args[0], env, binding);
 
   return binding;
 }
 
 
 lobj_t * form_setq(lobj_t * args[2], lobj_t ** env) {
+  lobj_t * binding = lobj_eval(args[1], env);
   lobj_t * name = args[0];
-  lobj_t * binding = args[1];
-  update(name, env, lobj_eval(binding, env));
+
+  if (islref(name)) {
+    lref_t * ref = tolref(name);
+    lobj_t * frame = *env;
+    for (int i = 0; i < ref->depth; i++) frame = toframe(frame)->parent;
+    write_barrier(frame, binding);
+    toframe(frame)->slots[ref->slot] = binding;
+  } else {
+    update(name, env, binding);
+  }
 
   return binding;
 }
@@ -412,17 +757,32 @@ lobj_t * form_if(lobj_t * args[3], lobj_t ** env) {
 
 
 lobj_t * form_fn(lobj_t * args[2], lobj_t ** env) {
-  return new_proc(args[0], args[1], env, 0, EVAL_PROC);
+  lobj_t * scope = new_cons(args[0], NIL), * body;
+  preserve(&scope);
+  body = resolve(args[1], scope);
+  release(1);
+
+  return new_proc(args[0], body, *env, 0, EVAL_PROC);
+}
+
+lobj_t * form_closure(lobj_t * args[2], lobj_t ** env) {
+  return new_proc(args[0], args[1], *env, 0, EVAL_PROC);
+}
+
+lobj_t * form_constant(lobj_t * args[1], lobj_t ** env) {
+  return args[0];
 }
 
 
 lobj_t * form_do(lobj_t * args[1], lobj_t ** env) {
-  lobj_t * out = NIL;
+  lobj_t * out = NIL, * body = args[0];
+  preserve(&body);
 
-  for (lobj_t * body = args[0]; !isnil(body); body = cdr(body)) {
+  for (; !isnil(body); body = cdr(body)) {
     out = lobj_eval(car(body), env);
   }
 
+  release(1);
   return out;
 }
 
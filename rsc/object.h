@@ -20,14 +20,17 @@ will be needed.
 #include "rascal.h"
 
 // type codes
-enum { LOBJ_CONS, LOBJ_SYM, LOBJ_ERR, LOBJ_PROC, LOBJ_NUM, LOBJ_PRIM, LOBJ_FORM, LOBJ_STR };
+enum { LOBJ_CONS, LOBJ_SYM, LOBJ_ERR, LOBJ_PROC, LOBJ_NUM, LOBJ_PRIM, LOBJ_FORM, LOBJ_STR, LOBJ_FRAME, LOBJ_LREF, LOBJ_CONST, LOBJ_FREE, LOBJ_FWD, LOBJ_CODE, LOBJ_VEC, LOBJ_ARR, LOBJ_STRBUF };
 /*
-GC tags. GC_GREY is included for use in a future implementation
-of a tricolor collector. GC_WHITE objects will be collected when
-the garbage collector is run. GC_BLACK objects are protected from
-collection.
+GC tags. GC_WHITE objects will be collected when the garbage collector
+is run. GC_GREY objects are reachable but their fields have not been
+scanned yet. GC_BLACK objects are protected from collection.
  */
 enum { GC_WHITE, GC_GREY, GC_BLACK };
+// Set on old objects that are in the remembered set (see write_barrier)
+#define GC_REMEMBERED 0x40000000
+#define GC_COLOR(obj)      ((obj)->tag & 3)
+#define gc_paint(obj, c)   ((obj)->tag = ((obj)->tag & GC_REMEMBERED) | (c))
 
 /*
 Eval type tags. Define when and how a procedural form is evaluated. 
@@ -39,8 +42,7 @@ enum { EVAL_PROC, EVAL_FORM, EVAL_MACRO };
  */
 #define LOBJ_HEAD \
   int type;       \
-  int tag;        \
-  lobj_t * next;  
+  int tag;
 
 #define LOBJ_PROC_HEAD \
   LOBJ_HEAD            \
@@ -54,6 +56,46 @@ typedef struct _lobj_t {
 
 #define LOBJ_CAST(obj) ((lobj_t*)(obj))
 
+/*
+Tagged words
+
+Heap objects are at least 8-byte aligned, so the low bits of a real pointer are
+always zero. Words with the low bit set are fixnums (the value shifted left by one).
+Words whose low two bits are 10 are the immediate constants nil, t and undef. Neither
+kind has a header, so the type of a value must be read with lobj_type rather than
+through ->type. Numbers outside the fixnum range are boxed in a num_t.
+*/
+#define isptr(obj)       ((((uintptr_t)(obj)) & 3) == 0)
+#define isfixnum(obj)    ((((uintptr_t)(obj)) & 1) == 1)
+#define isconst(obj)     ((((uintptr_t)(obj)) & 3) == 2)
+#define FIXNUM_MAX       (LONG_MAX >> 1)
+#define FIXNUM_MIN       (LONG_MIN >> 1)
+#define fixnum(n)        ((lobj_t*)((((uintptr_t)(n)) << 1) | 1))
+#define fixnum_val(obj)  (((intptr_t)(obj)) >> 1)
+#define lobj_type(obj)   (isfixnum(obj) ? LOBJ_NUM : isconst(obj) ? LOBJ_CONST : (obj)->type)
+#define isyoung(obj)     (isptr(obj) && (char*)(obj) >= NURSERY && (char*)(obj) < NURSERY_END)
+
+// Operations of num_op, in the order of the VM opcodes from OP_ADD
+enum { NUM_ADD, NUM_SUB, NUM_MUL, NUM_DIV, NUM_MOD, NUM_POW };
+
+/*
+Write barrier. Any store of a pointer into an existing object must go through
+write_barrier first, so that old objects pointing into the nursery are found by the
+next minor collection, and so that a value stored while the incremental marker is
+running is greyed before the marker can miss it. Global bindings use global_barrier.
+*/
+void remember(lobj_t *);
+void remember_global(gbind_t *);
+void grey(lobj_t *);
+#define write_barrier(obj, value)                                                   \
+  do { if (GC_STATE == GC_MARKING) grey(value);                                     \
+       if (isyoung(value) && !isyoung(obj) &&                                       \
+           !(__atomic_load_n(&(obj)->tag, __ATOMIC_RELAXED) & GC_REMEMBERED))            \
+         remember(obj); } while (0)
+#define global_barrier(binding, value)                                              \
+  do { if (GC_STATE == GC_MARKING) grey(value);                                     \
+       if (isyoung(value) && !(binding)->remembered) remember_global(binding); } while (0)
+
 typedef struct _num_t {
   LOBJ_HEAD
   long value;
@@ -72,14 +114,58 @@ typedef struct _cons_t {
 
 typedef struct _sym_t {
   LOBJ_HEAD
+  uint64_t hash;
   char * name;
 } sym_t;
 
+/*
+Strings carry their length and are not NUL-terminated. A string made by str-slice shares
+the buffer of the string it was cut from: chars points into that buffer and base is the
+string that owns it, which the slice keeps alive. base is nil for a string that owns its
+chars. The hash is computed the first time it is needed (see str_hash); 0 means not yet.
+*/
 typedef struct _str_t {
   LOBJ_HEAD
-  char * value;
+  long len;
+  uint64_t hash;
+  char * chars;
+  lobj_t * base;
 } str_t;
 
+// A string builder: a buffer that grows by doubling, so appending is amortized O(1)
+typedef struct _strbuf_t {
+  LOBJ_HEAD
+  long len;
+  long cap;
+  char * chars;
+} strbuf_t;
+
+#define STRBUF_INIT 16
+
+/*
+Vectors. The elements are stored inline after the header, so indexing is O(1). Like
+frames, a vector small enough for the nursery is allocated there; a larger one goes
+straight to the old space and is remembered until the next minor collection.
+*/
+typedef struct _vec_t {
+  LOBJ_HEAD
+  long len;
+  lobj_t * items[];
+} vec_t;
+
+// The pointer-reversing marker keeps the index of the field it is visiting in the tag
+#define VEC_MAX (1L << 27)
+
+// Typed arrays hold unboxed 64-bit integers and have no fields for the collector to
+// trace (see array.c)
+typedef struct _arr_t {
+  LOBJ_HEAD
+  long len;
+  int64_t items[];
+} arr_t;
+
+#define ARR_MAX (1L << 32)
+
 /*
 
 Procedures
@@ -103,17 +189,86 @@ typedef struct _lambda_t {
   LOBJ_PROC_HEAD
   lobj_t * formals;
   lobj_t * body;
-  lobj_t ** env;
+  lobj_t * env;
+  // Compiled body (a code_t), or nil until the lambda is first called
+  lobj_t * code;
     } lambda_t;
 
+/*
+Bytecode. A lambda body is compiled to a code_t the first time the lambda
+is called (see vm.c). Code objects are always allocated in the old space,
+so the VM can hold pointers into instrs while it runs.
+*/
+typedef struct _code_t {
+  LOBJ_HEAD
+  int ninstrs;
+  int nconsts;
+  int32_t * instrs;
+  struct _icache_t * caches;
+  lobj_t * consts[];
+} code_t;
+
+// Inline cache for one global reference in a code object: the binding, once it
+// exists, and the binding's version when the site last checked its value
+typedef struct _icache_t {
+  gbind_t * binding;
+  unsigned version;
+} icache_t;
+
+/*
+
+Local environments
+
+When a lambda is created its body is resolved: every reference to a local
+variable is replaced by an lref_t giving the number of frames to walk up
+and the slot to read. A call binds its arguments in a single flat frame
+whose parent is the frame the lambda closed over. The top level has no
+frame (nil); anything not resolved to a local is looked up in GLOBALS.
+
+*/
+
+typedef struct _frame_t {
+  LOBJ_HEAD
+  lobj_t * parent;
+  int size;
+  lobj_t * slots[];
+} frame_t;
+
+typedef struct _lref_t {
+  LOBJ_HEAD
+  int depth;
+  int slot;
+  lobj_t * name;
+} lref_t;
+
+/*
+Global bindings. A binding is allocated once and never moves, so pointers
+to it stay valid when the table is resized. version is bumped by every store
+(see global_set) and is never 0, so a cache of anything derived from the value
+can tell whether it is still current.
+ */
+typedef struct _gbind_t {
+  lobj_t * name;
+  lobj_t * value;
+  int remembered;
+  unsigned version;
+} gbind_t;
+
 // Type/nil checking macros
-#define iscons(obj)    ((obj)->type == LOBJ_CONS)
-#define isnum(obj)     ((obj)->type == LOBJ_NUM)
-#define issym(obj)     ((obj)->type == LOBJ_SYM)
-#define iserr(obj)     ((obj)->type == LOBJ_ERR)
-#define isprim(obj)    ((obj)->type == LOBJ_PRIM)
-#define isproc(obj)    ((obj)->type == LOBJ_PROC)
-#define isstring(obj)  ((obj)->type == LOBJ_STR)
+#define hastype(obj, t) (isptr(obj) && (obj)->type == (t))
+#define iscons(obj)    hastype(obj, LOBJ_CONS)
+#define isnum(obj)     (isfixnum(obj) || hastype(obj, LOBJ_NUM))
+#define issym(obj)     hastype(obj, LOBJ_SYM)
+#define iserr(obj)     hastype(obj, LOBJ_ERR)
+#define isprim(obj)    hastype(obj, LOBJ_PRIM)
+#define isproc(obj)    hastype(obj, LOBJ_PROC)
+#define isstring(obj)  hastype(obj, LOBJ_STR)
+#define isframe(obj)   hastype(obj, LOBJ_FRAME)
+#define islref(obj)    hastype(obj, LOBJ_LREF)
+#define iscode(obj)    hastype(obj, LOBJ_CODE)
+#define isvec(obj)     hastype(obj, LOBJ_VEC)
+#define isarr(obj)     hastype(obj, LOBJ_ARR)
+#define isstrbuf(obj)  hastype(obj, LOBJ_STRBUF)
 #define isnil(obj)     ((uint64_t)(obj)==(uint64_t)NIL)
 #define isunbound(obj) ((uint64_t)(obj)==(uint64_t)UNBOUND)
 #define ismacro(obj)   \
@@ -128,31 +283,59 @@ lobj_t * new_num(long);
 cons_t * mk_cons(lobj_t *, lobj_t *);
 lobj_t * new_cons(lobj_t *, lobj_t *);
 sym_t * mk_sym(char *);
+sym_t * mk_symn(char *, long);
 lobj_t * new_sym(char *);
+lobj_t * new_symn(char *, long);
+void symtab_sweep();
 str_t * mk_str(char *);
 lobj_t * new_str(char *);
+str_t * mk_strn(char *, long);
+lobj_t * new_strn(char *, long);
+strbuf_t * mk_strbuf(long);
+lobj_t * new_strbuf(long);
 prim_t * mk_prim(proc_t, int, int, int);
 lobj_t * new_prim(proc_t, int, int, int);
-lambda_t * mk_proc(lobj_t *, lobj_t *, lobj_t **, int, int);
-lobj_t * new_proc(lobj_t *, lobj_t *, lobj_t **, int, int);
+lambda_t * mk_proc(lobj_t *, lobj_t *, lobj_t *, int, int);
+lobj_t * new_proc(lobj_t *, lobj_t *, lobj_t *, int, int);
+frame_t * mk_frame(lobj_t *, int);
+lobj_t * new_frame(lobj_t *, int);
+lref_t * mk_lref(lobj_t *, int, int);
+lobj_t * new_lref(lobj_t *, int, int);
+code_t * mk_code(int32_t *, int, lobj_t *, int, int);
+vec_t * mk_vec(long, lobj_t *);
+lobj_t * new_vec(long, lobj_t *);
+lobj_t * list_to_vec(lobj_t *);
+arr_t * mk_arr(long);
+lobj_t * new_arr(long);
 
 // Safecast operators
 cons_t * tocons(lobj_t *);
-num_t * tonum(lobj_t *);
+long tonum(lobj_t *);
 err_t * toerr(lobj_t *);
 sym_t * tosym(lobj_t *);
 str_t * tostring(lobj_t *);
 prim_t * toprim(lobj_t *);
 lambda_t * toproc(lobj_t *);
+frame_t * toframe(lobj_t *);
+lref_t * tolref(lobj_t *);
+code_t * tocode(lobj_t *);
+vec_t * tovec(lobj_t *);
+arr_t * toarr(lobj_t *);
+strbuf_t * tostrbuf(lobj_t *);
 
 // Helpers & primitives
 lobj_t * lobj_copy(lobj_t *);
+gbind_t * global_ref(lobj_t *);
+gbind_t * global_def(lobj_t *, lobj_t *);
+void global_set(gbind_t *, lobj_t *);
 lobj_t * lookup(lobj_t *, lobj_t **);
-lobj_t * assoc(lobj_t *, lobj_t **);
-lobj_t * intern(lobj_t *, lobj_t **, lobj_t *);
+lobj_t ** frame_slot(lobj_t *, int, int);
 void update(lobj_t *, lobj_t **, lobj_t *);
 void puts_env(lobj_t *, lobj_t **, lobj_t *);
+lobj_t * lobj_eq(lobj_t *, lobj_t *);
 lobj_t * prim_eq(lobj_t * args[2], lobj_t **);
+int num_op(int, long, long, long *);
+long num_arith(int, long, long);
 lobj_t * prim_add(lobj_t * args[2], lobj_t **);
 lobj_t * prim_sub(lobj_t * args[2], lobj_t **);
 lobj_t * prim_mul(lobj_t * args[2], lobj_t **);
@@ -166,12 +349,22 @@ lobj_t * prim_eval(lobj_t * args[2], lobj_t **);
 lobj_t * prim_apply(lobj_t * args[3], lobj_t **);
 lobj_t * prim_globals(lobj_t ** args, lobj_t **);
 lobj_t * prim_allocations(lobj_t ** args, lobj_t **);
+lobj_t * prim_heap_stats(lobj_t ** args, lobj_t **);
 lobj_t * prim_print(lobj_t * args[1], lobj_t **);
+lobj_t * prim_make_vec(lobj_t * args[2], lobj_t **);
+lobj_t * prim_vec_ref(lobj_t * args[2], lobj_t **);
+lobj_t * prim_vec_set(lobj_t * args[3], lobj_t **);
+lobj_t * prim_vec_len(lobj_t * args[1], lobj_t **);
+lobj_t * prim_vec_slice(lobj_t * args[3], lobj_t **);
+lobj_t * prim_vec_to_list(lobj_t * args[1], lobj_t **);
+lobj_t * prim_list_to_vec(lobj_t * args[1], lobj_t **);
 lobj_t * form_def(lobj_t * args[2], lobj_t **);
 lobj_t * form_setq(lobj_t * args[2], lobj_t **);
 lobj_t * form_quote(lobj_t * args[1], lobj_t **);
 lobj_t * form_if(lobj_t * args[3], lobj_t **);
 lobj_t * form_fn(lobj_t * args[2], lobj_t **);
+lobj_t * form_closure(lobj_t * args[2], lobj_t **);
+lobj_t * form_constant(lobj_t * args[1], lobj_t **);
 lobj_t * form_do(lobj_t * args[1], lobj_t **);
 lobj_t * form_unquote(lobj_t * args[1], lobj_t **);
 
@@ -183,23 +376,38 @@ lobj_t * form_unquote(lobj_t * args[1], lobj_t **);
 
 #define LRAISE(fmt, ...) \
   ({ CURRENT_ERROR = new_err(fmt, ##__VA_ARGS__); longjmp(TOPLEVEL, 1); })
+
+// Any allocation may collect, so a local holding an object across one must be pushed on
+// the shadow stack with preserve(&x, ...) and popped with release(n) before returning.
+#define preserve(...)                                                       \
+  do { lobj_t ** _locals[] = { __VA_ARGS__ };                               \
+       size_t _n = sizeof(_locals) / sizeof(_locals[0]);                    \
+       LASSERT(SHADOW_SP + _n <= SHADOW_MAX, "stack overflow")              \
+       memcpy(&SHADOW[SHADOW_SP], _locals, sizeof(_locals));                \
+       SHADOW_SP += _n; } while (0)
+#define release(n)           (SHADOW_SP -= (n))
  
 // Accessors and mutators for data types. Those prefixed with f are unsafe but faster
 #define car(pair)            (tocons(pair)->_car)
 #define cdr(pair)            (tocons(pair)->_cdr)
-#define setcar(pair, value)  (tocons(pair)->_car = (value))
-#define setcdr(pair, value)  (tocons(pair)->_cdr = (value))
+#define setcar(pair, value)  ({ cons_t * _p = tocons(pair); lobj_t * _v = (value);     \
+                                write_barrier(LOBJ_CAST(_p), _v); _p->_car = _v; })
+#define setcdr(pair, value)  ({ cons_t * _p = tocons(pair); lobj_t * _v = (value);     \
+                                write_barrier(LOBJ_CAST(_p), _v); _p->_cdr = _v; })
 #define fcar(pair)           (((cons_t*)(pair))->_car)
 #define fcdr(pair)           (((cons_t*)(pair))->_cdr)
-#define fsetcar(pair, v)     (((cons_t*)(pair))->_car = (v))
-#define fsetcdr(pair, v)     (((cons_t*)(pair))->_cdr = (v))
+#define fsetcar(pair, v)     ({ lobj_t * _v = (v); write_barrier(LOBJ_CAST(pair), _v); ((cons_t*)(pair))->_car = _v; })
+#define fsetcdr(pair, v)     ({ lobj_t * _v = (v); write_barrier(LOBJ_CAST(pair), _v); ((cons_t*)(pair))->_cdr = _v; })
 
-// Macros for comparing symbols and environments. Those prefixed with f are unsafe but faster
-#define cmpsym(sym1, sym2)   (strcmp(tosym(sym1)->name, tosym(sym2)->name))
+// Macros for comparing symbols and environments. Those prefixed with f are unsafe but faster.
+// Symbols are interned, so they are ordered and compared by address rather than by name.
+#define ptrcmp(p1, p2)       (((uintptr_t)(p1) > (uintptr_t)(p2)) - ((uintptr_t)(p1) < (uintptr_t)(p2)))
+#define cmpsym(sym1, sym2)   (ptrcmp(tosym(sym1), tosym(sym2)))
+#define symeq(sym1, sym2)    (tosym(sym1) == tosym(sym2))
 #define cmpstrsym(str, sym)  (strcmp((str), tosym(sym)->name))
 #define cmpsymstr(sym, str)  (strcmp(tosym(sym)->name, (str)))
 #define symnameq(sym, str)   (strcmp(tosym(sym)->name, (str)) == 0)
-#define fcmpsym(sym1, sym2)  (strcmp(((sym_t*)(sym1))->name, ((sym_t*)(sym2))->name))
+#define fcmpsym(sym1, sym2)  (ptrcmp((sym1), (sym2)))
 #define fcmpstrsym(str, sym) (strcmp((str), ((sym_t*)(sym))->name))
 #define fcmpsymstr(sym, str) (strcmp(((sym_t*)(sym))->name, str))
 #define fsymnameq(sym, str)  (strcmp(((sym_t*)(sym))->name, str) == 0)
@@ -0,0 +1,581 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "pool.h"
+#include "eval.h"
+#include "util.h"
+#include "vm.h"
+
+
+/*
+Copying between heaps. Objects are read from the context from, which must not be running,
+and rebuilt in the current one. Frames, lambdas, vectors, arrays and string builders are
+copied once however often they are reached, so shared and circular structures keep their
+shape; their copies are held on STACK from base while the copy runs. Source objects are
+never registered with preserve: they are not in this heap and do not move.
+ */
+typedef struct _xfer_t {
+  rascal_ctx * from;
+  ptrmap_t memo;    // source object -> its copy's offset from base, plus one
+  size_t base;
+} xfer_t;
+
+static lobj_t * transfer(xfer_t *, lobj_t *);
+
+static lobj_t * memo_find(xfer_t * x, lobj_t * obj) {
+  unsigned * i = ptrmap_slot(&x->memo, obj);
+
+  return *i ? STACK[x->base + *i - 1] : NULL;
+}
+
+static void memo_add(xfer_t * x, lobj_t * obj, lobj_t * copy) {
+  *ptrmap_slot(&x->memo, obj) = SP - x->base + 1;
+  push(copy);
+}
+
+static lobj_t * transfer_list(xfer_t * x, lobj_t * xs) {
+  lobj_t * out = NIL, * last = NIL, * cell = NIL;
+  preserve(&out, &last, &cell);
+
+  for (; iscons(xs); xs = fcdr(xs)) {
+    cell = transfer(x, fcar(xs));
+    cell = new_cons(cell, NIL);
+    if (isnil(last)) out = cell; else fsetcdr(last, cell);
+    last = cell;
+  }
+
+  if (!isnil(xs)) {
+    cell = transfer(x, xs);
+    fsetcdr(last, cell);
+  }
+
+  release(3);
+  return out;
+}
+
+static lobj_t * transfer_proc(xfer_t * x, lambda_t * fun) {
+  lobj_t * out = new_proc(NIL, NIL, NIL, fun->vararg, fun->evaltype), * part = NIL;
+  preserve(&out, &part);
+  memo_add(x, LOBJ_CAST(fun), out);
+  toproc(out)->argc = fun->argc;
+
+  // The code is not copied: it is compiled again against this context's globals
+  part = transfer(x, fun->formals);
+  write_barrier(out, part);
+  toproc(out)->formals = part;
+  part = transfer(x, fun->body);
+  write_barrier(out, part);
+  toproc(out)->body = part;
+  part = transfer(x, fun->env);
+  write_barrier(out, part);
+  toproc(out)->env = part;
+
+  release(2);
+  return out;
+}
+
+static lobj_t * transfer_frame(xfer_t * x, frame_t * frame) {
+  lobj_t * out = new_frame(NIL, frame->size), * part = NIL;
+  preserve(&out, &part);
+  memo_add(x, LOBJ_CAST(frame), out);
+
+  part = transfer(x, frame->parent);
+  write_barrier(out, part);
+  toframe(out)->parent = part;
+
+  for (int i = 0; i < frame->size; i++) {
+    part = transfer(x, frame->slots[i]);
+    write_barrier(out, part);
+    toframe(out)->slots[i] = part;
+  }
+
+  release(2);
+  return out;
+}
+
+static lobj_t * transfer_vec(xfer_t * x, vec_t * vec) {
+  lobj_t * out = new_vec(vec->len, NIL), * part = NIL;
+  preserve(&out, &part);
+  memo_add(x, LOBJ_CAST(vec), out);
+
+  for (long i = 0; i < vec->len; i++) {
+    part = transfer(x, vec->items[i]);
+    write_barrier(out, part);
+    tovec(out)->items[i] = part;
+  }
+
+  release(2);
+  return out;
+}
+
+static lobj_t * transfer_arr(xfer_t * x, arr_t * arr) {
+  lobj_t * out = new_arr(arr->len);
+  memo_add(x, LOBJ_CAST(arr), out);
+  memcpy(toarr(out)->items, arr->items, arr->len * sizeof(int64_t));
+
+  return out;
+}
+
+static lobj_t * transfer_strbuf(xfer_t * x, strbuf_t * buf) {
+  lobj_t * out = new_strbuf(buf->cap);
+  memo_add(x, LOBJ_CAST(buf), out);
+  memcpy(tostrbuf(out)->chars, buf->chars, buf->len);
+  tostrbuf(out)->len = buf->len;
+
+  return out;
+}
+
+static lobj_t * transfer(xfer_t * x, lobj_t * obj) {
+  lobj_t * out;
+
+  switch (lobj_type(obj)) {
+  case LOBJ_CONST: return obj;
+  case LOBJ_NUM:   return new_num(tonum(obj));
+  case LOBJ_SYM:   return new_sym(tosym(obj)->name);
+  // A slice is copied on its own, without the rest of its base
+  case LOBJ_STR:   return new_strn(tostring(obj)->chars, tostring(obj)->len);
+  case LOBJ_ERR:   return new_err("%s", toerr(obj)->msg);
+  case LOBJ_CONS:  return transfer_list(x, obj);
+  case LOBJ_LREF:
+    out = transfer(x, tolref(obj)->name);
+    return new_lref(out, tolref(obj)->depth, tolref(obj)->slot);
+  case LOBJ_PRIM:
+    if (obj == x->from->closure) return CLOSURE;
+    if (obj == x->from->constant) return CONSTANT;
+    return new_prim(toprim(obj)->body, toprim(obj)->argc, toprim(obj)->vararg, toprim(obj)->evaltype);
+  case LOBJ_PROC:
+    out = memo_find(x, obj);
+    return out != NULL ? out : transfer_proc(x, toproc(obj));
+  case LOBJ_FRAME:
+    out = memo_find(x, obj);
+    return out != NULL ? out : transfer_frame(x, toframe(obj));
+  case LOBJ_VEC:
+    out = memo_find(x, obj);
+    return out != NULL ? out : transfer_vec(x, tovec(obj));
+  case LOBJ_ARR:
+    out = memo_find(x, obj);
+    return out != NULL ? out : transfer_arr(x, toarr(obj));
+  case LOBJ_STRBUF:
+    out = memo_find(x, obj);
+    return out != NULL ? out : transfer_strbuf(x, tostrbuf(obj));
+  default:
+    LRAISE("Type Error: cannot copy type %i between interpreters", lobj_type(obj));
+  }
+}
+
+// Copy obj out of the context from into the current one
+static lobj_t * copy_from(rascal_ctx * from, lobj_t * obj) {
+  xfer_t x = { from, { 0 }, SP };
+  jmp_buf outer;
+  lobj_t * out;
+
+  // An error is passed on to the caller's handler once the memo is freed
+  memcpy(outer, TOPLEVEL, sizeof(jmp_buf));
+  if (setjmp(TOPLEVEL)) {
+    ptrmap_free(&x.memo);
+    memcpy(TOPLEVEL, outer, sizeof(jmp_buf));
+    longjmp(TOPLEVEL, 1);
+  }
+
+  out = transfer(&x, obj);
+  memcpy(TOPLEVEL, outer, sizeof(jmp_buf));
+
+  SP = x.base;
+  ptrmap_free(&x.memo);
+
+  return out;
+}
+
+
+/*
+The pool. Workers wait for JOB_GEN to change, run chunks of JOB until there are none left
+to claim or steal, and then leave their results on their own STACK, where the caller reads
+them once PENDING reaches 0. A worker does not allocate between jobs, so its results stay
+where they are until the next job starts.
+ */
+typedef struct _worker_t {
+  pthread_t thread;
+  rascal_ctx * ctx;
+  pthread_mutex_t lock;
+  // Chunks not yet claimed, taken from the front by the worker and stolen from the back
+  int lo;
+  int hi;
+  ptrmap_t imported;
+  ptrmap_t seen;
+  rascal_ctx * imported_from;
+} worker_t;
+
+typedef struct _job_t {
+  int reduce;
+  rascal_ctx * from;
+  lobj_t * fun;
+  lobj_t * init;
+  lobj_t ** items;
+  int nitems;
+  int nchunks;
+  int chunksize;
+  // The worker holding each result (one per item for pmap, per chunk for preduce) and
+  // its index on that worker's STACK
+  int * owner;
+  size_t * slot;
+  int failed;
+  char * error;
+} job_t;
+
+static worker_t * WORKERS;
+static int NWORKERS;
+static __thread worker_t * SELF;
+// Held by the caller for the whole of a job, so one list is split at a time
+static pthread_mutex_t POOL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t JOB_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t JOB_POSTED = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t JOB_DONE = PTHREAD_COND_INITIALIZER;
+static job_t * JOB;
+static unsigned JOB_GEN;
+static int PENDING;
+static int READY;
+
+// Take the next chunk, stealing the back half of another worker's range if ours is empty
+static int claim(worker_t * w, int * chunk) {
+  pthread_mutex_lock(&w->lock);
+  int found = w->lo < w->hi;
+  if (found) *chunk = w->lo++;
+  pthread_mutex_unlock(&w->lock);
+
+  for (int k = 1; !found && k < NWORKERS; k++) {
+    worker_t * v = &WORKERS[(w - WORKERS + k) % NWORKERS];
+    int lo = 0, hi = 0;
+
+    pthread_mutex_lock(&v->lock);
+    if (v->lo < v->hi) {
+      hi = v->hi;
+      lo = v->hi - (v->hi - v->lo + 1) / 2;
+      v->hi = lo;
+    }
+    pthread_mutex_unlock(&v->lock);
+
+    if (lo < hi) {
+      pthread_mutex_lock(&w->lock);
+      w->lo = lo + 1;
+      w->hi = hi;
+      pthread_mutex_unlock(&w->lock);
+      *chunk = lo;
+      found = 1;
+    }
+  }
+
+  return found;
+}
+
+static void import_globals(worker_t *, rascal_ctx *, lobj_t *);
+
+// Bring the caller's binding of name into this worker if it has changed since it was
+// last copied, then do the same for the globals its value refers to
+static void import_global(worker_t * w, rascal_ctx * from, lobj_t * name) {
+  rascal_ctx * self = RASCAL;
+  RASCAL = from;
+  gbind_t * b = global_ref(name);
+  RASCAL = self;
+
+  if (b == NULL || *ptrmap_slot(&w->seen, b)) return;
+  *ptrmap_slot(&w->seen, b) = 1;
+
+  unsigned * version = ptrmap_slot(&w->imported, b);
+
+  if (*version != b->version) {
+    *version = b->version;
+
+    lobj_t * sym = new_sym(tosym(name)->name), * value;
+    gbind_t * mine = global_ref(sym);
+
+    // Primitives are the same in every context; rebinding them would only discard the
+    // guards compiled against them
+    if (!(isprim(b->value) && mine != NULL && isprim(mine->value) &&
+          toprim(mine->value)->body == toprim(b->value)->body)) {
+      preserve(&sym);
+      value = copy_from(from, b->value);
+      global_def(sym, value);
+      release(1);
+    }
+  }
+
+  import_globals(w, from, b->value);
+}
+
+// Import every global named in the code or environment of obj, which belongs to from
+static void import_globals(worker_t * w, rascal_ctx * from, lobj_t * obj) {
+  while (1) {
+    switch (lobj_type(obj)) {
+    case LOBJ_SYM:
+      import_global(w, from, obj);
+      return;
+    case LOBJ_CONS:
+      if (fcar(obj) == from->constant) return;
+      for (; iscons(obj); obj = fcdr(obj)) import_globals(w, from, fcar(obj));
+      return;
+    case LOBJ_PROC:
+      if (*ptrmap_slot(&w->seen, obj)) return;
+      *ptrmap_slot(&w->seen, obj) = 1;
+      import_globals(w, from, toproc(obj)->body);
+      obj = toproc(obj)->env;
+      break;
+    case LOBJ_FRAME:
+      if (*ptrmap_slot(&w->seen, obj)) return;
+      *ptrmap_slot(&w->seen, obj) = 1;
+      for (int i = 0; i < toframe(obj)->size; i++) import_globals(w, from, toframe(obj)->slots[i]);
+      obj = toframe(obj)->parent;
+      break;
+    case LOBJ_VEC:
+      if (*ptrmap_slot(&w->seen, obj)) return;
+      *ptrmap_slot(&w->seen, obj) = 1;
+      for (long i = 0; i < tovec(obj)->len; i++) import_globals(w, from, tovec(obj)->items[i]);
+      return;
+    default:
+      return;
+    }
+  }
+}
+
+// Copy the function (and the initial value) to STACK[0] (and STACK[1])
+static void prepare(worker_t * w, job_t * job) {
+  lobj_t * x;
+
+  if (w->imported_from != job->from) {
+    ptrmap_clear(&w->imported);
+    w->imported_from = job->from;
+  }
+
+  ptrmap_clear(&w->seen);
+  import_globals(w, job->from, job->fun);
+
+  x = copy_from(job->from, job->fun);
+  push(x);
+  x = job->reduce ? copy_from(job->from, job->init) : NIL;
+  push(x);
+}
+
+static void run_chunk(worker_t * w, job_t * job, int chunk) {
+  int lo = chunk * job->chunksize, hi = lo + job->chunksize;
+  lobj_t * acc = NIL, * x = NIL;
+  preserve(&acc, &x);
+
+  if (hi > job->nitems) hi = job->nitems;
+
+  if (job->reduce) {
+    // Only the first chunk starts from init; the rest start from their first item
+    acc = chunk == 0 ? STACK[1] : copy_from(job->from, job->items[lo++]);
+  }
+
+  for (int i = lo; i < hi; i++) {
+    x = copy_from(job->from, job->items[i]);
+    x = new_cons(x, NIL);
+    if (job->reduce) x = new_cons(acc, x);
+    x = apply_values(STACK[0], &TOPENV, x);
+
+    if (job->reduce) {
+      acc = x;
+    } else {
+      job->owner[i] = w - WORKERS;
+      job->slot[i] = SP;
+      push(x);
+    }
+  }
+
+  if (job->reduce) {
+    job->owner[chunk] = w - WORKERS;
+    job->slot[chunk] = SP;
+    push(acc);
+  }
+
+  release(2);
+}
+
+static void run_job(worker_t * w, job_t * job) {
+  int chunk, prepared = 0;
+
+  SP = 0;
+  SHADOW_SP = 0;
+  ENV = CODE = NIL;
+
+  if (setjmp(TOPLEVEL)) {
+    pthread_mutex_lock(&JOB_LOCK);
+    if (!job->failed) job->error = strdup(toerr(CURRENT_ERROR)->msg);
+    job->failed = 1;
+    pthread_mutex_unlock(&JOB_LOCK);
+    return;
+  }
+
+  while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED) && claim(w, &chunk)) {
+    if (!prepared) prepare(w, job);
+    prepared = 1;
+    run_chunk(w, job, chunk);
+  }
+}
+
+static void * worker_main(void * arg) {
+  worker_t * w = arg;
+  unsigned gen = 0;
+
+  SELF = w;
+  w->ctx = rascal_new();
+
+  pthread_mutex_lock(&JOB_LOCK);
+  READY++;
+  pthread_cond_broadcast(&JOB_DONE);
+
+  while (1) {
+    while (JOB_GEN == gen) pthread_cond_wait(&JOB_POSTED, &JOB_LOCK);
+    gen = JOB_GEN;
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    run_job(w, JOB);
+
+    pthread_mutex_lock(&JOB_LOCK);
+    if (--PENDING == 0) pthread_cond_broadcast(&JOB_DONE);
+  }
+
+  return NULL;
+}
+
+static void pool_start() {
+  char * n = getenv("RASCAL_WORKERS");
+  NWORKERS = n != NULL ? atoi(n) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (NWORKERS < 1) NWORKERS = 1;
+
+  WORKERS = calloc(NWORKERS, sizeof(worker_t));
+
+  for (int i = 0; i < NWORKERS; i++) {
+    pthread_mutex_init(&WORKERS[i].lock, NULL);
+    pthread_create(&WORKERS[i].thread, NULL, worker_main, &WORKERS[i]);
+  }
+
+  pthread_mutex_lock(&JOB_LOCK);
+  while (READY < NWORKERS) pthread_cond_wait(&JOB_DONE, &JOB_LOCK);
+  pthread_mutex_unlock(&JOB_LOCK);
+}
+
+// Run job on the pool and return its results, copied into this context, as a list
+static lobj_t * pool_run(job_t * job, lobj_t * xs) {
+  int nresults;
+  lobj_t * out = NIL, * last = NIL, * cell = NIL;
+  jmp_buf outer;
+
+  job->from = RASCAL;
+  job->nitems = list_len(xs);
+  job->items = malloc(job->nitems * sizeof(lobj_t*));
+  for (int i = 0; i < job->nitems; i++, xs = cdr(xs)) job->items[i] = car(xs);
+
+  pthread_mutex_lock(&POOL_LOCK);
+  if (WORKERS == NULL) pool_start();
+
+  job->nchunks = NWORKERS * POOL_CHUNKS_PER_WORKER;
+  if (job->nchunks > job->nitems) job->nchunks = job->nitems;
+  job->chunksize = (job->nitems + job->nchunks - 1) / job->nchunks;
+  job->nchunks = (job->nitems + job->chunksize - 1) / job->chunksize;
+  nresults = job->reduce ? job->nchunks : job->nitems;
+  job->owner = malloc(nresults * sizeof(int));
+  job->slot = malloc(nresults * sizeof(size_t));
+
+  for (int i = 0; i < NWORKERS; i++) {
+    WORKERS[i].lo = (long)job->nchunks * i / NWORKERS;
+    WORKERS[i].hi = (long)job->nchunks * (i + 1) / NWORKERS;
+  }
+
+  // Nothing in this context may move until the workers are done reading it
+  pthread_mutex_lock(&JOB_LOCK);
+  JOB = job;
+  PENDING = NWORKERS;
+  JOB_GEN++;
+  pthread_cond_broadcast(&JOB_POSTED);
+  while (PENDING > 0) pthread_cond_wait(&JOB_DONE, &JOB_LOCK);
+  pthread_mutex_unlock(&JOB_LOCK);
+
+  // The workers' results are only safe until the pool is unlocked, so an error while
+  // copying them unlocks it and frees the job before it is passed on
+  memcpy(outer, TOPLEVEL, sizeof(jmp_buf));
+  if (setjmp(TOPLEVEL)) {
+    pthread_mutex_unlock(&POOL_LOCK);
+    free(job->items);
+    free(job->owner);
+    free(job->slot);
+    memcpy(TOPLEVEL, outer, sizeof(jmp_buf));
+    longjmp(TOPLEVEL, 1);
+  }
+
+  preserve(&out, &last, &cell);
+
+  for (int i = 0; !job->failed && i < nresults; i++) {
+    rascal_ctx * from = WORKERS[job->owner[i]].ctx;
+    cell = copy_from(from, from->stack[job->slot[i]]);
+    cell = new_cons(cell, NIL);
+    if (isnil(last)) out = cell; else fsetcdr(last, cell);
+    last = cell;
+  }
+
+  memcpy(TOPLEVEL, outer, sizeof(jmp_buf));
+  pthread_mutex_unlock(&POOL_LOCK);
+  release(3);
+
+  free(job->items);
+  free(job->owner);
+  free(job->slot);
+
+  if (job->failed) {
+    char msg[512];
+    snprintf(msg, sizeof(msg), "%s", job->error);
+    free(job->error);
+    LRAISE("%s", msg);
+  }
+
+  return out;
+}
+
+// Map fun over xs, in parallel unless this thread is already a worker
+lobj_t * prim_pmap(lobj_t * args[2], lobj_t ** env) {
+  lobj_t * out = NIL, * last = NIL, * cell = NIL, * xs = args[1];
+
+  if (isnil(xs)) return NIL;
+
+  if (SELF == NULL) {
+    job_t job = { .reduce = 0, .fun = args[0], .init = NIL };
+    return pool_run(&job, xs);
+  }
+
+  preserve(&out, &last, &cell, &xs);
+
+  for (; !isnil(xs); xs = cdr(xs)) {
+    cell = new_cons(car(xs), NIL);
+    cell = apply_values(args[0], env, cell);
+    cell = new_cons(cell, NIL);
+    if (isnil(last)) out = cell; else fsetcdr(last, cell);
+    last = cell;
+  }
+
+  release(4);
+  return out;
+}
+
+// Fold fun over xs from init. Chunks are folded separately and their results folded
+// in order, so fun must be associative.
+lobj_t * prim_preduce(lobj_t * args[3], lobj_t ** env) {
+  lobj_t * acc = args[1], * xs = args[2], * x = NIL;
+
+  if (isnil(xs)) return acc;
+
+  preserve(&acc, &xs, &x);
+
+  if (SELF == NULL) {
+    job_t job = { .reduce = 1, .fun = args[0], .init = args[1] };
+    xs = pool_run(&job, xs);
+    acc = car(xs);
+    xs = cdr(xs);
+  }
+
+  for (; !isnil(xs); xs = cdr(xs)) {
+    x = new_cons(car(xs), NIL);
+    x = new_cons(acc, x);
+    acc = apply_values(args[0], env, x);
+  }
+
+  release(3);
+  return acc;
+}
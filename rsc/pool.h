@@ -0,0 +1,31 @@
+#ifndef pool_h
+#define pool_h
+#include "rascal.h"
+#include "object.h"
+
+/*
+
+Worker pool
+
+pmap and preduce split a list into chunks and run them on a pool of worker threads,
+each of which is an interpreter of its own (see rascal_new) with its own heap and
+collector. The function and the elements are copied into the worker's heap, along
+with the globals the function refers to, and the results are copied back into the
+caller's heap by the caller. Objects are never shared between heaps, so the workers
+need no locks while they evaluate. Each worker owns a range of the chunks; one that
+runs out steals half of the range another has left.
+
+The function should not depend on mutable state: a worker's copy of a global or of a
+closed-over variable is not written back. The pool is started by the first call, with
+one worker per core or RASCAL_WORKERS workers, and runs one list at a time. Calls made
+from inside a worker run on that worker's thread without splitting.
+
+*/
+
+#define POOL_CHUNKS_PER_WORKER 8
+
+/* Forward declarations */
+lobj_t * prim_pmap(lobj_t * args[2], lobj_t **);
+lobj_t * prim_preduce(lobj_t * args[3], lobj_t **);
+
+#endif
@@ -1,14 +1,33 @@
 #include "printer.h"
+#include "alloc.h"
 
 void lobj_print(lobj_t * v) {
-  switch(v->type) {
-  case LOBJ_NUM:   printf("%li", tonum(v)->value); break;
+  switch(lobj_type(v)) {
+  case LOBJ_NUM:   printf("%li", tonum(v)); break;
+  case LOBJ_CONST: printf("%s", isnil(v) ? "nil" : v == TRUE ? "t" : "undef"); break;
   case LOBJ_ERR:   printf("Error: %s", toerr(v)->msg); break;
   case LOBJ_SYM:   printf("%s", tosym(v)->name); break;
-  case LOBJ_STR:   printf("\"%s\"", tostring(v)->value); break;
+  case LOBJ_STR:   printf("\"%.*s\"", (int)tostring(v)->len, tostring(v)->chars); break;
+  case LOBJ_STRBUF: printf("#strbuf"); break;
   case LOBJ_CONS:  lobj_expr_print(v, '(', ')'); break;
   case LOBJ_PRIM:
   case LOBJ_PROC:  printf("#proc"); break;
+  case LOBJ_FRAME: printf("#frame"); break;
+  case LOBJ_CODE:  printf("#code"); break;
+  case LOBJ_VEC:
+    printf("#[");
+    for (long i = 0; i < tovec(v)->len; i++) {
+      if (i > 0) putchar(' ');
+      lobj_print(tovec(v)->items[i]);
+    }
+    putchar(']');
+    break;
+  case LOBJ_ARR:
+    printf("#i64[");
+    for (long i = 0; i < toarr(v)->len; i++) printf(i > 0 ? " %li" : "%li", (long)toarr(v)->items[i]);
+    putchar(']');
+    break;
+  case LOBJ_LREF:  lobj_print(tolref(v)->name); break;
   default: printf("#");
   }
 }
@@ -41,9 +60,26 @@ void show_proc_info(prim_t * fun) {
 }
 
 void show_alloc_list() {
-  lobj_t * curr = ALLOC;
-  while (curr) {
-    lobj_println(curr);
-    curr = curr->next;
+  heap_walk(lobj_println);
+}
+
+void show_heap_stats() {
+  size_t large = 0, large_bytes = 0;
+
+  sweep_finish();
+  printf("%-6s %8s %10s %10s\n", "cell", "slabs", "live", "free");
+  for (int p = 0; p < NPOOLS; p++) {
+    pool_t * pool = &POOLS[p];
+    size_t cells = 0;
+    for (slab_t * slab = pool->slabs; slab; slab = slab->next) cells += slab->ncells;
+    printf("%-6zu %8zu %10zu %10zu%s\n", pool->cellsize, pool->nslabs, cells - pool->nfree, pool->nfree,
+           p == POOL_CONS ? "  (cons)" : "");
+  }
+
+  for (large_t * l = LARGE; l; l = l->next) {
+    large++;
+    large_bytes += l->size;
   }
+  printf("large: %zu objects, %zu bytes\n", large, large_bytes);
+  printf("nursery: %zu of %d bytes used\n", (size_t)(NURSERY_TOP - NURSERY), NURSERY_SIZE);
 }
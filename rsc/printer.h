@@ -14,6 +14,7 @@ void lobj_print_str(lobj_t *);
 // Debug
 void show_proc_info(prim_t *);
 void show_alloc_list();
+void show_heap_stats();
 void show_globals();
 
 #endif
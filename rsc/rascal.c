@@ -13,75 +13,181 @@ Public Domain.
 #include "printer.h"
 #include "eval.h"
 #include "gc.h"
+#include "alloc.h"
+#include "vm.h"
+#include "pool.h"
+#include "array.h"
+#include "str.h"
+#include "image.h"
 
+__thread rascal_ctx * RASCAL;
+
+// Every primitive bound in the global environment. A heap image refers to primitives by
+// their index here, so new ones go at the end.
+primdef_t PRIMITIVES[] = {
+  { "eq?", prim_eq, 2, EVAL_PROC },
+  { "+", prim_add, 2, EVAL_PROC },
+  { "-", prim_sub, 2, EVAL_PROC },
+  { "*", prim_mul, 2, EVAL_PROC },
+  { "/", prim_div, 2, EVAL_PROC },
+  { "%", prim_mod, 2, EVAL_PROC },
+  { "pow", prim_pow, 2, EVAL_PROC },
+  { "cons", prim_cons, 2, EVAL_PROC },
+  { "head", prim_head, 1, EVAL_PROC },
+  { "tail", prim_tail, 1, EVAL_PROC },
+  { "eval", prim_eval, 2, EVAL_PROC },
+  { "apply", prim_apply, 3, EVAL_PROC },
+  { "globals", prim_globals, 0, EVAL_PROC },
+  { "allocations", prim_allocations, 0, EVAL_PROC },
+  { "heap-stats", prim_heap_stats, 0, EVAL_PROC },
+  { "print", prim_print, 1, EVAL_PROC },
+  { "make-vec", prim_make_vec, 2, EVAL_PROC },
+  { "vec-ref", prim_vec_ref, 2, EVAL_PROC },
+  { "vec-set!", prim_vec_set, 3, EVAL_PROC },
+  { "vec-len", prim_vec_len, 1, EVAL_PROC },
+  { "vec-slice", prim_vec_slice, 3, EVAL_PROC },
+  { "vec->list", prim_vec_to_list, 1, EVAL_PROC },
+  { "list->vec", prim_list_to_vec, 1, EVAL_PROC },
+  { "make-arr", prim_make_arr, 2, EVAL_PROC },
+  { "arr-range", prim_arr_range, 2, EVAL_PROC },
+  { "arr-ref", prim_arr_ref, 2, EVAL_PROC },
+  { "arr-set!", prim_arr_set, 3, EVAL_PROC },
+  { "arr-len", prim_arr_len, 1, EVAL_PROC },
+  { "list->arr", prim_list_to_arr, 1, EVAL_PROC },
+  { "arr->list", prim_arr_to_list, 1, EVAL_PROC },
+  { "arr-sum", prim_arr_sum, 1, EVAL_PROC },
+  { "arr-min", prim_arr_min, 1, EVAL_PROC },
+  { "arr-max", prim_arr_max, 1, EVAL_PROC },
+  { "arr-dot", prim_arr_dot, 2, EVAL_PROC },
+  { "arr+", prim_arr_add, 2, EVAL_PROC },
+  { "arr-", prim_arr_sub, 2, EVAL_PROC },
+  { "arr*", prim_arr_mul, 2, EVAL_PROC },
+  { "arr/", prim_arr_div, 2, EVAL_PROC },
+  { "arr<", prim_arr_lt, 2, EVAL_PROC },
+  { "arr>", prim_arr_gt, 2, EVAL_PROC },
+  { "arr=", prim_arr_eq, 2, EVAL_PROC },
+  { "str-len", prim_str_len, 1, EVAL_PROC },
+  { "str-ref", prim_str_ref, 2, EVAL_PROC },
+  { "str-slice", prim_str_slice, 3, EVAL_PROC },
+  { "str-cat", prim_str_cat, 2, EVAL_PROC },
+  { "str=", prim_str_eq, 2, EVAL_PROC },
+  { "str-hash", prim_str_hash, 1, EVAL_PROC },
+  { "make-strbuf", prim_make_strbuf, 0, EVAL_PROC },
+  { "strbuf-append!", prim_strbuf_append, 2, EVAL_PROC },
+  { "strbuf-len", prim_strbuf_len, 1, EVAL_PROC },
+  { "strbuf->str", prim_strbuf_to_str, 1, EVAL_PROC },
+  { "def", form_def, 2, EVAL_FORM },
+  { "setq", form_setq, 2, EVAL_FORM },
+  { "quote", form_quote, 1, EVAL_MACRO },
+  { "if", form_if, 3, EVAL_FORM },
+  { "fn", form_fn, 2, EVAL_FORM },
+  { "do", form_do, 1, EVAL_FORM },
+  { "unquote", form_unquote, 1, EVAL_MACRO },
+  { "pmap", prim_pmap, 2, EVAL_PROC },
+  { "preduce", prim_preduce, 3, EVAL_PROC },
+  { "save-image", prim_save_image, 1, EVAL_PROC },
+};
+
+const int NPRIMITIVES = sizeof(PRIMITIVES) / sizeof(PRIMITIVES[0]);
 
 void initialize_lisp() {
   CURRENT_ERROR = NULL;
   ROOT = NULL;
-  ALLOCATIONS = 3;
-  
-
-  NIL = LOBJ_CAST(mk_sym("nil"));
-  UNBOUND = LOBJ_CAST(mk_sym("undef"));
-  TRUE = LOBJ_CAST(mk_sym("t"));
+  ALLOCATIONS = 0;
+  init_gc();
+  init_alloc();
   
-  ALLOC = NIL;
-  LINK(UNBOUND);
-  LINK(TRUE);
-  GLOBALS = NIL;
-
-  puts_env(NIL, &GLOBALS, NIL);
-  puts_env(UNBOUND, &GLOBALS, UNBOUND);
-  puts_env(TRUE, &GLOBALS, TRUE);
-  puts_env(new_sym("eq?"), &GLOBALS, new_prim(prim_eq, 2, 0, EVAL_PROC));
-  puts_env(new_sym("+"), &GLOBALS, new_prim(prim_add,  2, 0, EVAL_PROC));
-  puts_env(new_sym("-"), &GLOBALS, new_prim(prim_sub, 2, 0, EVAL_PROC));
-  puts_env(new_sym("*"), &GLOBALS, new_prim(prim_mul, 2, 0, EVAL_PROC));
-  puts_env(new_sym("/"), &GLOBALS, new_prim(prim_div, 2, 0, EVAL_PROC));
-  puts_env(new_sym("%"), &GLOBALS, new_prim(prim_mod, 2, 0, EVAL_PROC));
-  puts_env(new_sym("pow"), &GLOBALS, new_prim(prim_pow, 2, 0, EVAL_PROC));
-  puts_env(new_sym("cons"), &GLOBALS, new_prim(prim_cons, 2, 0, EVAL_PROC));
-  puts_env(new_sym("head"), &GLOBALS, new_prim(prim_head, 1, 0, EVAL_PROC));
-  puts_env(new_sym("tail"), &GLOBALS, new_prim(prim_tail, 1, 0, EVAL_PROC));
-  puts_env(new_sym("eval"), &GLOBALS, new_prim(prim_eval, 2, 0, EVAL_PROC));
-  puts_env(new_sym("apply"), &GLOBALS, new_prim(prim_apply, 3, 0, EVAL_PROC));
-  puts_env(new_sym("globals"), &GLOBALS, new_prim(prim_globals, 0, 0, EVAL_PROC));
-  puts_env(new_sym("allocations"), &GLOBALS, new_prim(prim_allocations, 0, 0, EVAL_PROC));
-  puts_env(new_sym("print"), &GLOBALS, new_prim(prim_print, 1, 0, EVAL_PROC));
-  puts_env(new_sym("def"), &GLOBALS, new_prim(form_def, 2, 0, EVAL_FORM));
-  puts_env(new_sym("setq"), &GLOBALS, new_prim(form_setq, 2, 0, EVAL_FORM));
-  puts_env(new_sym("quote"), &GLOBALS, new_prim(form_quote, 1, 0, EVAL_MACRO));
-  puts_env(new_sym("if"), &GLOBALS, new_prim(form_if, 3, 0, EVAL_FORM));
-  puts_env(new_sym("fn"), &GLOBALS, new_prim(form_fn, 2, 0, EVAL_FORM));
-  puts_env(new_sym("do"), &GLOBALS, new_prim(form_do, 1, 0, EVAL_FORM));
-  puts_env(new_sym("unquote"), &GLOBALS, new_prim(form_unquote, 1, 0, EVAL_MACRO));
-
-  lobj_println(GLOBALS);
+  CLOSURE = LOBJ_CAST(mk_prim(form_closure, 2, 0, EVAL_FORM));
+  CONSTANT = LOBJ_CAST(mk_prim(form_constant, 1, 0, EVAL_FORM));
   
+  TOPENV = NIL;
+  ACCUM = ENV = CODE = NIL;
+
+  // Everything below is in the heap image, if one was opened
+  if (image_load()) return;
+
+  puts_env(new_sym("nil"), &TOPENV, NIL);
+  puts_env(new_sym("undef"), &TOPENV, UNBOUND);
+  puts_env(new_sym("t"), &TOPENV, TRUE);
+  for (int i = 0; i < NPRIMITIVES; i++) {
+    puts_env(new_sym(PRIMITIVES[i].name), &TOPENV,
+             new_prim(PRIMITIVES[i].body, PRIMITIVES[i].argc, 0, PRIMITIVES[i].evaltype));
+  }
+
   // Load standard library
-  load_lisp_file("prelude.rsp", &GLOBALS);
+  load_lisp_file("prelude.rsp", &TOPENV);
   return;
 }
 
+// Create an interpreter with a heap of its own and make it the calling thread's
+rascal_ctx * rascal_new() {
+  RASCAL = calloc(1, sizeof(rascal_ctx));
+  SHADOW = malloc(SHADOW_MAX * sizeof(lobj_t**));
+  STACK = malloc(STACKSIZE * sizeof(lobj_t*));
+  initialize_lisp();
+
+  return RASCAL;
+}
+
+// Destroy an interpreter and everything allocated in it
+void rascal_free(rascal_ctx * ctx) {
+  rascal_ctx * current = RASCAL;
+  RASCAL = ctx;
+
+  free_gc();
+  free_alloc();
+
+  for (size_t i = 0; i < GLOBALS_CAP; i++) free(GLOBALS[i]);
+  free(GLOBALS);
+  free(SYMTAB);
+  free(SHADOW);
+  free(STACK);
+  free(ctx);
+
+  RASCAL = current == ctx ? NULL : current;
+}
+
 int main(int argc, char** argv) {
+  char * script = NULL, * err;
+  src_t in;
 
-  initialize_lisp();
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "--image") && i + 1 < argc) {
+      err = image_open(argv[++i]);
+      if (err != NULL) {
+        fprintf(stderr, "%s: %s\n", argv[i], err);
+        return 1;
+      }
+    } else {
+      script = argv[i];
+    }
+  }
+
+  rascal_new();
+  lobj_println(prim_globals(NULL, NULL));
   puts("Rascal Version 0.0.0.1.5");
   puts("Press ctrl+c to Exit\n");
 
-  if (argc > 1) {
-    load_lisp_file(argv[1], &GLOBALS);
-  }
+  // An error in the script is reported like one at the prompt
+  if (setjmp(TOPLEVEL)) lobj_println(CURRENT_ERROR);
+  else if (script != NULL) load_lisp_file(script, &TOPENV);
+
+  src_fd(&in, fileno(stdin));
   
   while (1) {
     if (setjmp(TOPLEVEL)) lobj_println(CURRENT_ERROR);
+    SHADOW_SP = 0;
+    SP = 0;
+    ENV = CODE = NIL;
     printf("rascal> ");
-    ROOT = read_expr(stdin);
-    if (feof(stdin)) break;
-    lobj_println(lobj_eval(ROOT, &GLOBALS));
+    fflush(stdout);
+    ROOT = read_expr(&in);
+    if (in.done) break;
+    lobj_println(lobj_eval(expand_quotes(ROOT), &TOPENV));
 
-    if (ALLOCATIONS > ALLOCATIONS_LIMIT) gc();
+    gc_safepoint();
   }
-  
+
+  src_close(&in);
   return 0;
 }
@@ -12,6 +12,8 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
 
 // Forward type declarations
 typedef struct _lobj_t lobj_t;
@@ -26,44 +28,157 @@ typedef lobj_t * (*proc_t) (lobj_t**, lobj_t**);
 typedef struct _prim_t prim_t;
 typedef struct _form_t form_t;
 typedef struct _lambda_t lambda_t;
+typedef struct _gbind_t gbind_t;
+typedef struct _frame_t frame_t;
+typedef struct _lref_t lref_t;
+typedef struct _rascal_ctx rascal_ctx;
+
+/*
+Interpreter context
+
+All of the interpreter's mutable state lives in a rascal_ctx, so several interpreters,
+each with its own heap and collector, can run in one process. RASCAL is the context the
+current thread is running; it is set by rascal_new and can be switched by assigning it.
+A context must only be used by one thread at a time. The globals below, and the ones in
+alloc.h, gc.h, vm.h and reader.h, are names for fields of RASCAL.
+*/
+struct _rascal_ctx {
+  gbind_t ** globals;
+  size_t globals_count;
+  size_t globals_cap;
+  lobj_t * topenv;
+  lobj_t * root;
+  lobj_t *** shadow;
+  size_t shadow_sp;
+  lobj_t * current_error;
+  jmp_buf toplevel;
+  lobj_t * closure;
+  lobj_t * constant;
+  int allocations;
+  int gc_threshold;
+  char * nursery;
+  char * nursery_top;
+  char * nursery_end;
+  int gc_state;
+  long gc_pause_us;
+  int gc_step_count;
+  int gc_threads;
+  sym_t ** symtab;
+  size_t symtab_count;
+  size_t symtab_cap;
+  // alloc.h
+  struct _pool_t * pools;
+  struct _large_t * large;
+  // gc.h
+  lobj_t ** mark_stack;
+  size_t mark_sp;
+  size_t mark_cap;
+  lobj_t ** promote_stack;
+  size_t promote_sp;
+  size_t promote_cap;
+  lobj_t ** remset;
+  size_t remset_count;
+  size_t remset_cap;
+  gbind_t ** remset_globals;
+  size_t remset_globals_count;
+  size_t remset_globals_cap;
+  size_t unswept_slabs;
+  pthread_t sweeper;
+  int sweep_thread;
+  pthread_mutex_t sweep_lock;
+  pthread_cond_t sweep_work;
+  pthread_cond_t sweep_idle;
+  int sweep_busy;
+  int sweep_quit;
+  int swept_dead;
+  // vm.h
+  lobj_t * accum;
+  lobj_t * env;
+  lobj_t * code;
+  lobj_t ** stack;
+  size_t sp;
+  // reader.h
+  uint32_t toktype;
+  lobj_t * tokval;
+};
+
+extern __thread rascal_ctx * RASCAL;
+
+rascal_ctx * rascal_new();
+void rascal_free(rascal_ctx *);
 
 /* Global variables  */
 // Memory and stack management, environment
-lobj_t * GLOBALS;
-// Head of the list of all allocated objects
-lobj_t * ALLOC;
+// Global environment. An open-addressing hash table of bindings keyed by symbol.
+#define GLOBALS       (RASCAL->globals)
+#define GLOBALS_COUNT (RASCAL->globals_count)
+#define GLOBALS_CAP   (RASCAL->globals_cap)
+#define GLOBALS_INIT_CAP 256
+// Environment of top-level forms. There is no local frame at the top level,
+// so this is always nil.
+#define TOPENV        (RASCAL->topenv)
 // Head of all reachable objects
-lobj_t * ROOT;
-lobj_t * CURRENT_ERROR;
-jmp_buf TOPLEVEL;
+#define ROOT          (RASCAL->root)
+// Shadow stack. C locals that must survive an allocation are registered here (see
+// preserve in object.h), so the collector can trace them and update them when it moves
+// an object out of the nursery.
+#define SHADOW_MAX (1 << 20)
+#define SHADOW        (RASCAL->shadow)
+#define SHADOW_SP     (RASCAL->shadow_sp)
+#define CURRENT_ERROR (RASCAL->current_error)
+#define TOPLEVEL      (RASCAL->toplevel)
 /* 
 Nil and nil checks 
-For now Nil is a unique symbol created when the interpreter is initialized.
-Its address is recorded and used to check for nil, and it is stored in a global variable
-for easy access. This system is clumsy but easier and less error prone for now than the
-current implementation (all references to nil lookup nil in the global environment).
-This is a target for  optimization once the interpreter is fleshed out and working reliably.
+nil, t and undef are immediate constants: tagged words that are never allocated,
+so they can be compared by value and are ignored by the collector. See the tagging
+scheme in object.h.
 */
-// Reference to unique NIL object
-lobj_t * NIL;
-// Reference to unique UNBOUND object for unbound symbols
-lobj_t * UNBOUND;
-// Unique reference to TRUE object used as return value from
+// Unique NIL object
+#define NIL     ((lobj_t*)0x2)
+// Unique UNBOUND object for unbound symbols
+#define UNBOUND ((lobj_t*)0x6)
+// Unique TRUE object used as return value from
 // boolean functions
-lobj_t * TRUE;
-int ALLOCATIONS;
-// Arbitrary allocation limit (should research a good one)
+#define TRUE    ((lobj_t*)0xa)
+// Form that builds a closure from a lambda whose body has already been resolved.
+// Nested `fn` forms are rewritten to use it so their bodies are resolved only once.
+#define CLOSURE       (RASCAL->closure)
+// Form that returns its argument as it is. Quoted data that needs no expansion is
+// rewritten to use it when a top-level form is read (see expand_quotes).
+#define CONSTANT      (RASCAL->constant)
+// Number of objects in the old (mark/sweep) space
+#define ALLOCATIONS   (RASCAL->allocations)
+// Arbitrary allocation limit (should research a good one). A major collection runs once
+// ALLOCATIONS passes GC_THRESHOLD, which is raised to twice the live count after each one.
 #define ALLOCATIONS_LIMIT 256
-// Read buffer
-char BUFFER[2048];
-// Add an object to the linked list of allocated objects.
-#define LINK(ob)         \
-  do {                   \
-      ob->next = ALLOC ; \
-      ALLOC = ob ;       \
-      ALLOCATIONS++ ;    \
-       } while (0)
-
+#define GC_THRESHOLD  (RASCAL->gc_threshold)
+// Nursery. New objects are bump-allocated here and copied to the old space by a minor
+// collection if they survive.
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (1024 * 1024)
+#endif
+#define NURSERY       (RASCAL->nursery)
+#define NURSERY_TOP   (RASCAL->nursery_top)
+#define NURSERY_END   (RASCAL->nursery_end)
+// Incremental collector state. Marking advances in slices of at most GC_PAUSE_US
+// microseconds, run every GC_STEP_INTERVAL allocations, and sweeping runs on a thread of
+// its own when there is more than one core. The pause is read from RASCAL_GC_PAUSE_US;
+// a pause of 0 marks the whole heap at once.
+enum { GC_IDLE, GC_MARKING, GC_SWEEPING };
+#define GC_PAUSE_DEFAULT 1000
+#define GC_STEP_INTERVAL 256
+#define GC_STATE      (RASCAL->gc_state)
+#define GC_PAUSE_US   (RASCAL->gc_pause_us)
+#define GC_STEP_COUNT (RASCAL->gc_step_count)
+// Number of threads that finish marking a large heap (see gc.c), read from
+// RASCAL_GC_THREADS. The default of 1 marks on the collecting thread alone.
+#define GC_THREADS    (RASCAL->gc_threads)
+// Symbol table. Every symbol is interned here, so two symbols with the same
+// name are the same object and can be compared by address.
+#define SYMTAB        (RASCAL->symtab)
+#define SYMTAB_COUNT  (RASCAL->symtab_count)
+#define SYMTAB_CAP    (RASCAL->symtab_cap)
+#define SYMTAB_INIT_CAP 256
 
 // String utilities
 #define streq(s1, s2) (strcmp((s1),(s2))==0)
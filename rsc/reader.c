@@ -1,158 +1,268 @@
 #include "reader.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-/* Reader  */
-char nextchar(FILE * f) {
-  char c;
-  int ch;
-
-  do {
-      ch = fgetc(f);
-      if (ch == EOF) return 0;
-
-      c = (char)ch;
-      if (c == ';') {
-        do {
-             ch = fgetc(f);
-             if (ch == EOF) return 0;
-           } while ((char)ch != '\n');
-
-      c = (char)ch;
-      }
-    } while (isspacec(c));
-    return c;
+// One byte per character: CC_SPACE for SPACE_CHARS, CC_SYM for SYMBOL_CHARS and CC_NUM for NUMBER_CHARS
+const unsigned char CHAR_CLASS[256] = {
+  [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\v'] = CC_SPACE, ['\r'] = CC_SPACE, ['\n'] = CC_SPACE,
+  ['a' ... 'z'] = CC_SYM, ['A' ... 'Z'] = CC_SYM, ['0' ... '9'] = CC_SYM | CC_NUM,
+  ['-'] = CC_SYM | CC_NUM, ['_'] = CC_SYM, ['+'] = CC_SYM, ['*'] = CC_SYM, ['\\'] = CC_SYM,
+  ['/'] = CC_SYM, ['%'] = CC_SYM, ['='] = CC_SYM, ['<'] = CC_SYM, ['>'] = CC_SYM,
+  ['!'] = CC_SYM, ['&'] = CC_SYM, ['?'] = CC_SYM,
+};
+
+/* Sources */
+// Read from fd a block at a time (a terminal or a pipe)
+void src_fd(src_t * s, int fd) {
+  *s = (src_t){ .fd = fd };
 }
 
-void accumchar(char c, int *pi){
-  READ_BUFFER[(*pi)++] = c;
-  if (*pi >= (int)(sizeof(READ_BUFFER)-1)) {
-    puts("Warning: read buffer overflow.");
+// Append the next block of input, keeping everything from s->mark on. Returns the number of bytes read.
+static size_t src_fill(src_t * s) {
+  ssize_t n;
+
+  if (s->fd < 0) return 0;
+
+  if (s->mark > 0) {
+    memmove(s->buf, s->buf + s->mark, s->len - s->mark);
+    s->len -= s->mark;
+    s->pos -= s->mark;
+    s->mark = 0;
+  }
+
+  if (s->cap - s->len < SRC_BLOCK) {
+    s->cap = s->cap ? s->cap * 2 : SRC_BLOCK;
+    s->buf = realloc(s->buf, s->cap);
+  }
+
+  do n = read(s->fd, s->buf + s->len, s->cap - s->len); while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    s->fd = -1;
+    return 0;
   }
+
+  s->len += n;
+  return n;
 }
 
-int read_token(FILE * f, char c) {
-  int i = 0, ch;
+// Map the file whole, or failing that (an empty file, a device) read it whole. Returns -1 if it can't be opened.
+int src_open(src_t * s, char * fname) {
+  struct stat st;
+  int fd = open(fname, O_RDONLY);
 
-    ungetc(c, f);
+  if (fd < 0) return -1;
+  src_fd(s, fd);
 
-    while (1) {
-      ch = fgetc(f);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    s->buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (s->buf != MAP_FAILED) {
+      madvise(s->buf, st.st_size, MADV_SEQUENTIAL);
+      s->mapped = 1;
+      s->len = s->cap = st.st_size;
+      s->fd = -1;
+    } else {
+      s->buf = NULL;
+    }
+  }
+
+  while (src_fill(s)) continue;
+  close(fd);
+  return 0;
+}
 
-      if (ch == EOF) break;
+void src_close(src_t * s) {
+  if (s->mapped) munmap(s->buf, s->cap);
+  else free(s->buf);
+  s->buf = NULL;
+}
+
+/* Reader  */
+// nil, t and undef read as the immediate constants rather than as symbols
+static lobj_t * read_symbol(char * name, size_t len) {
+  if (len == 3 && memcmp(name, "nil", 3) == 0) return NIL;
+  if (len == 1 && *name == 't') return TRUE;
+  if (len == 5 && memcmp(name, "undef", 5) == 0) return UNBOUND;
 
-      c = (char)ch;
-      
-      if (!issymc(c)) break;
+  return new_symn(name, len);
+}
 
-      accumchar(c, &i);
+// Skip whitespace and comments. Returns the next character without consuming it, or 0 at the end of input.
+static char skip_space(src_t * s) {
+  char * nl;
+
+  while (1) {
+    while (s->pos < s->len && isspacec(s->buf[s->pos])) s->pos++;
+
+    if (s->pos == s->len) {
+      s->mark = s->pos;
+      if (!src_fill(s)) return 0;
+      continue;
     }
 
- ungetc(c, f);
- 
- READ_BUFFER[i++] = '\0';
- return i;
+    if (s->buf[s->pos] != ';') return s->buf[s->pos];
+
+    nl = memchr(s->buf + s->pos, '\n', s->len - s->pos);
+    s->pos = nl ? (size_t)(nl - s->buf) : s->len;
+  }
 }
 
-uint32_t peek(FILE * f) {
-    char c, *end;
-    long x;
+// Scan the symbol characters from s->pos on. The token is s->buf[s->mark] to s->buf[s->pos].
+static void scan_token(src_t * s) {
+  s->mark = s->pos;
+
+  while (1) {
+    while (s->pos < s->len && issymc(s->buf[s->pos])) s->pos++;
+    if (s->pos < s->len || !src_fill(s)) return;
+  }
+}
 
-    if (TOKTYPE != TOK_NONE) return TOKTYPE;
+// Parse an optionally negative decimal integer. Returns 0 if the token isn't one or is out of range.
+static int parse_num(char * p, char * end, long * out) {
+  int neg = *p == '-';
+  long x = 0;
 
-    c = nextchar(f);
+  p += neg;
+  if (p == end) return 0;
 
-    if (feof(f)) return TOK_NONE;
+  for (; p < end; p++) {
+    if (*p < '0' || *p > '9') return 0;
+    if (__builtin_mul_overflow(x, 10, &x)) return 0;
+    if (neg ? __builtin_sub_overflow(x, *p - '0', &x) : __builtin_add_overflow(x, *p - '0', &x)) return 0;
+  }
+
+  *out = x;
+  return 1;
+}
 
-    if (strchr("([", c) != NULL) TOKTYPE = TOK_OPEN;
+uint32_t peek(src_t * s) {
+  char c, * start, * end, * p;
+  size_t n;
+  long x;
 
-    if (strchr(")]", c) != NULL) TOKTYPE = TOK_CLOSE;
+  if (TOKTYPE != TOK_NONE) return TOKTYPE;
+
+  c = skip_space(s);
+
+  if (c == 0) {
+    s->done = 1;
+    return TOK_NONE;
+  }
+
+  if (!issymc(c)) {
+    s->pos++;
+
+    if (c == '(' || c == '[') TOKTYPE = TOK_OPEN;
+
+    if (c == ')' || c == ']') TOKTYPE = TOK_CLOSE;
 
     if (c == ':') TOKTYPE = TOK_QUOTE;
 
-    if (c == '$') TOKTYPE = TOK_UNQUOTE; 
+    if (c == '$') TOKTYPE = TOK_UNQUOTE;
 
     if (c == '"') TOKTYPE = TOK_STR;
-    
-    if (issymc(c)) {
-        read_token(f, c);
-	
-
-	// Simplest way to handle "-" being technically a numerical string.
-	if (streq(READ_BUFFER, "-")) {
-	  TOKTYPE = TOK_SYM;
-	  TOKVAL = new_sym(READ_BUFFER);
-	} else  if (isnums(READ_BUFFER)) {
-	  TOKTYPE =  TOK_NUM;
-	    x = strtol(READ_BUFFER, &end, 10);
-	    if (*end != '\0') {
-	      TOKTYPE = TOK_ERROR;
-	      TOKVAL = new_err("Bad number input.");
-	    }
-	    
-	    TOKVAL = new_num(x);
-	    
-        } else {
-            TOKTYPE = TOK_SYM;
-            TOKVAL = new_sym(READ_BUFFER);
-        }
+
+    // #[ opens a vector literal
+    if (c == '#') {
+      LASSERT((s->pos < s->len || src_fill(s)) && s->buf[s->pos++] == '[', "read error: expected '[' after '#'")
+      TOKTYPE = TOK_VEC;
     }
+
     return TOKTYPE;
+  }
+
+  scan_token(s);
+  start = s->buf + s->mark;
+  end = s->buf + s->pos;
+  n = end - start;
+
+  for (p = start; p < end && isnumc(*p); p++) continue;
+
+  // "-" is technically a numerical string, but reads as a symbol
+  if (p == end && !(n == 1 && *start == '-')) {
+    LASSERT(parse_num(start, end, &x), "Bad number input.")
+    TOKTYPE = TOK_NUM;
+    TOKVAL = new_num(x);
+  } else {
+    TOKTYPE = TOK_SYM;
+    TOKVAL = read_symbol(start, n);
+  }
+
+  return TOKTYPE;
 }
 
 // build a list of conses.
-lobj_t * read_list(FILE *f) {
-  lobj_t * out = NIL, ** curr = &out;
-  uint32_t t = peek(f);
-  
+lobj_t * read_list(src_t * s) {
+  lobj_t * out = NIL, * last = NIL, * cell;
+  uint32_t t = peek(s);
+
+  preserve(&out, &last);
   while (t != TOK_CLOSE) {
-    LASSERT(!feof(f), "read error: unexpected end of input.")
-    *curr = new_cons(NIL, NIL);
-    setcar(*curr, read_expr(f));
-    curr = &cdr(*curr);    
-    t = peek(f);
+    LASSERT(!s->done, "read error: unexpected end of input.")
+    // The token peeked last is consumed by read_expr before anything is allocated
+    cell = new_cons(read_expr(s), NIL);
+    if (isnil(last)) out = cell; else setcdr(last, cell);
+    last = cell;
+    t = peek(s);
   }
+    release(2);
     take();
     return out;
 }
 
-lobj_t * read_str(FILE *f) {
-  int i = 0, c;
-  char ch = fgetc(f);
+// The characters up to the closing '"', which are taken from the source as they are
+lobj_t * read_str(src_t * s) {
+  char * q;
 
-    while (ch != '"') {
-      LASSERT(ch != EOF, "Unexpected EOF in string literal.")
-      c = (char)ch;
-      accumchar(c, &i);
-      ch = fgetc(f);
-    }
- 
- READ_BUFFER[i++] = '\0';
- return new_str(READ_BUFFER); 
+  s->mark = s->pos;
+
+  while (!(q = memchr(s->buf + s->pos, '"', s->len - s->pos))) {
+    s->pos = s->len;
+    LASSERT(src_fill(s), "Unexpected EOF in string literal.")
+  }
+
+  s->pos = q - s->buf + 1;
+  return new_strn(s->buf + s->mark, q - (s->buf + s->mark));
 }
 
-lobj_t * read_expr(FILE *f) {
-  if (feof(f)) return NIL;
-    switch (peek(f)) {
+// Read one expression and wrap it as (name expr)
+static lobj_t * read_wrapped(src_t * s, char * name) {
+  lobj_t * out = new_cons(read_expr(s), NIL), * head;
+  preserve(&out);
+  head = new_sym(name);
+  release(1);
+
+  return new_cons(head, out);
+}
+
+lobj_t * read_expr(src_t * s) {
+  if (s->done) return NIL;
+    switch (peek(s)) {
     case TOK_CLOSE:
         take();
         LRAISE("read error: unexpected ')'\n");
     case TOK_QUOTE:{
       take();
-      return new_cons(new_sym("quote"), new_cons(read_expr(f), NIL));
+      return read_wrapped(s, "quote");
     }
     case TOK_UNQUOTE:{
       take();
-      return new_cons(new_sym("unquote"), new_cons(read_expr(f), NIL));
-    } 
+      return read_wrapped(s, "unquote");
+    }
     case TOK_SYM:
     case TOK_NUM:
         take();
         return TOKVAL;
     case TOK_OPEN:{
         take();
-        return read_list(f);
+        return read_list(s);
+    }case TOK_VEC:{
+        take();
+        return list_to_vec(read_list(s));
     }case TOK_STR:{
        take();
-       return read_str(f);
+       return read_str(s);
      }
     }
 
@@ -162,14 +272,28 @@ lobj_t * read_expr(FILE *f) {
 
 lobj_t * load_lisp_file(char * fname, lobj_t ** env) {
   lobj_t * e, * v = NIL;
+  src_t s;
+  jmp_buf outer;
   LASSERT(strstr(fname, ".rsp"), "Invalid filename")
-  FILE * f = fopen(fname, "r");
-  LASSERT(f != NULL, "File not found.")  
+  LASSERT(src_open(&s, fname) == 0, "File not found.")
+
+  // An error is passed on to the caller's handler once the file is closed
+  memcpy(outer, TOPLEVEL, sizeof(jmp_buf));
+  if (setjmp(TOPLEVEL)) {
+    src_close(&s);
+    memcpy(TOPLEVEL, outer, sizeof(jmp_buf));
+    longjmp(TOPLEVEL, 1);
+  }
+
+    e = NIL;
+    preserve(&e, &v);
     while (1) {
-      e = read_expr(f);
-      if (feof(f)) break;
-      v = lobj_eval(e, env);
+      e = read_expr(&s);
+      if (s.done) break;
+      v = lobj_eval(expand_quotes(e), env);
     }
-    fclose(f);
-    return v; 
+    release(2);
+    memcpy(TOPLEVEL, outer, sizeof(jmp_buf));
+    src_close(&s);
+    return v;
 }
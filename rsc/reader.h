@@ -4,6 +4,19 @@
 #include "object.h"
 #include "eval.h"
 
+/*
+
+Reader
+
+Input is read from a src_t: a file is mapped into memory whole, and anything that cannot
+be mapped (a terminal, a pipe) is read into a buffer a block at a time, which grows to
+hold a token that spans blocks. Characters are classified with a table, so whitespace,
+comments and symbols are skipped over in bulk. Tokens are never copied into a buffer of
+their own: numbers are parsed, and symbols and strings are made, straight from the input,
+so they can be of any length.
+
+*/
+
 #define SYMBOL_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-*\\/%=<>!&?"
 #define NUMBER_CHARS "-0123456789"
 #define CONS_CHARS   "()[]"
@@ -11,29 +24,43 @@
 // #define ESCAPABLE    "\a\b\f\n\r\t\v\\\'\""
 // #define UNESCAPABLE  "abfnrtv\\\'\""
 
-enum { TOK_NONE, TOK_OPEN, TOK_CLOSE, TOK_STR, TOK_SYM, TOK_NUM, TOK_ERROR, TOK_QUOTE, TOK_UNQUOTE };
-static uint32_t TOKTYPE = TOK_NONE;
-static lobj_t * TOKVAL;
-static char READ_BUFFER[2048];
+enum { TOK_NONE, TOK_OPEN, TOK_CLOSE, TOK_STR, TOK_SYM, TOK_NUM, TOK_ERROR, TOK_QUOTE, TOK_UNQUOTE, TOK_VEC };
+#define TOKTYPE     (RASCAL->toktype)
+#define TOKVAL      (RASCAL->tokval)
+
+#define SRC_BLOCK 4096
+
+typedef struct _src_t {
+  int fd;         // refilled from here, or -1 once everything is in buf
+  int mapped;     // buf is a mapping of the whole file
+  int done;       // set when peek finds no more input
+  char * buf;
+  size_t pos;
+  size_t len;
+  size_t cap;
+  size_t mark;    // start of the token being scanned, which a refill keeps
+} src_t;
 
 static void take() { TOKTYPE = TOK_NONE;  }
 
 /* Forward declarations  */
-char nextchar(FILE *);
-void accumchar(char, int *);
-int read_token(FILE *, char);
-uint32_t peek(FILE *);
-lobj_t * read_list(FILE *);
-lobj_t * read_expr(FILE *);
-lobj_t * read_str(FILE *);
+void src_fd(src_t *, int);
+int src_open(src_t *, char *);
+void src_close(src_t *);
+uint32_t peek(src_t *);
+lobj_t * read_list(src_t *);
+lobj_t * read_expr(src_t *);
+lobj_t * read_str(src_t *);
 lobj_t * load_lisp_file(char *, lobj_t **);
 
+// Character classes (see CHAR_CLASS in reader.c)
+enum { CC_SPACE = 1, CC_SYM = 2, CC_NUM = 4 };
+extern const unsigned char CHAR_CLASS[256];
+
 // Helper macros for testing string characters
-#define isnumc(c)   (strchr(NUMBER_CHARS, c))
-#define issymc(c)   (strchr(SYMBOL_CHARS, c))
-#define isspacec(c) (strchr(SPACE_CHARS, c))
+#define isnumc(c)   (CHAR_CLASS[(unsigned char)(c)] & CC_NUM)
+#define issymc(c)   (CHAR_CLASS[(unsigned char)(c)] & CC_SYM)
+#define isspacec(c) (CHAR_CLASS[(unsigned char)(c)] & CC_SPACE)
 #define issexprc(c) (strchr(CONS_CHARS, c))
-#define isnums(s)   (strspn(s, NUMBER_CHARS) == strlen(s))
-#define issyms(s)   (strspn(s, SYMBOL_CHARS) == strlen(s))
 
 #endif
@@ -0,0 +1,130 @@
+#include "str.h"
+#include "util.h"
+#include "alloc.h"
+
+
+uint64_t str_hash(lobj_t * s) {
+  str_t * str = tostring(s);
+
+  if (str->hash == 0) str->hash = hash_mem(str->chars, str->len) | 1;
+
+  return str->hash;
+}
+
+static long str_index(lobj_t * s, lobj_t * i, long hi) {
+  long n = tonum(i);
+  LASSERT(n >= 0 && n < hi, "Index Error: %li out of range for string of length %li", n, tostring(s)->len)
+
+  return n;
+}
+
+lobj_t * prim_str_len(lobj_t * args[1], lobj_t ** env) {
+  return new_num(tostring(args[0])->len);
+}
+
+// The byte at i, as a number
+lobj_t * prim_str_ref(lobj_t * args[2], lobj_t ** env) {
+  return new_num((unsigned char)tostring(args[0])->chars[str_index(args[0], args[1], tostring(args[0])->len)]);
+}
+
+// The characters from start up to (not including) end, sharing the buffer of s
+lobj_t * prim_str_slice(lobj_t * args[3], lobj_t ** env) {
+  lobj_t * s = args[0];
+  long end = str_index(s, args[2], tostring(s)->len + 1);
+  long start = str_index(s, args[1], end + 1);
+  str_t * out;
+
+  preserve(&s);
+  out = (str_t*)lobj_alloc(LOBJ_STR, sizeof(str_t));
+  release(1);
+
+  out->len = end - start;
+  out->hash = 0;
+  out->chars = tostring(s)->chars + start;
+  // Slices of slices share the original buffer
+  out->base = isnil(tostring(s)->base) ? s : tostring(s)->base;
+
+  return LOBJ_CAST(out);
+}
+
+lobj_t * prim_str_cat(lobj_t * args[2], lobj_t ** env) {
+  lobj_t * x = args[0], * y = args[1];
+  str_t * a = tostring(x), * b = tostring(y), * out;
+  char * chars = malloc(a->len + b->len + 1);
+
+  memcpy(chars, a->chars, a->len);
+  memcpy(chars + a->len, b->chars, b->len);
+  chars[a->len + b->len] = '\0';
+
+  preserve(&x, &y);
+  out = (str_t*)lobj_alloc(LOBJ_STR, sizeof(str_t));
+  release(2);
+
+  out->len = a->len + b->len;
+  out->hash = 0;
+  out->chars = chars;
+  out->base = NIL;
+
+  return LOBJ_CAST(out);
+}
+
+lobj_t * prim_str_eq(lobj_t * args[2], lobj_t ** env) {
+  str_t * a = tostring(args[0]), * b = tostring(args[1]);
+
+  if (a->len != b->len) return NIL;
+  // Hashes are only compared if both are already known
+  if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return NIL;
+
+  return memcmp(a->chars, b->chars, a->len) == 0 ? TRUE : NIL;
+}
+
+lobj_t * prim_str_hash(lobj_t * args[1], lobj_t ** env) {
+  return new_num((long)str_hash(args[0]));
+}
+
+/* String builders */
+static void strbuf_add(strbuf_t * b, char * chars, long len) {
+  if (b->len + len > b->cap) {
+    while (b->len + len > b->cap) b->cap *= 2;
+    b->chars = realloc(b->chars, b->cap);
+  }
+
+  memcpy(b->chars + b->len, chars, len);
+  b->len += len;
+}
+
+lobj_t * prim_make_strbuf(lobj_t ** args, lobj_t ** env) {
+  return new_strbuf(0);
+}
+
+lobj_t * prim_strbuf_append(lobj_t * args[2], lobj_t ** env) {
+  strbuf_t * b = tostrbuf(args[0]);
+  lobj_t * x = args[1];
+  char num[24];
+
+  if (isstring(x)) {
+    strbuf_add(b, tostring(x)->chars, tostring(x)->len);
+  } else if (issym(x)) {
+    strbuf_add(b, tosym(x)->name, strlen(tosym(x)->name));
+  } else {
+    strbuf_add(b, num, snprintf(num, sizeof(num), "%li", tonum(x)));
+  }
+
+  return args[0];
+}
+
+lobj_t * prim_strbuf_len(lobj_t * args[1], lobj_t ** env) {
+  return new_num(tostrbuf(args[0])->len);
+}
+
+// Copy the contents of a builder, which can go on being appended to, into a string
+lobj_t * prim_strbuf_to_str(lobj_t * args[1], lobj_t ** env) {
+  lobj_t * b = args[0], * out;
+  strbuf_t * buf = tostrbuf(b);
+
+  preserve(&b);
+  out = new_strn(buf->chars, buf->len);
+  release(1);
+
+  return out;
+}
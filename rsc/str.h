@@ -0,0 +1,31 @@
+#ifndef str_h
+#define str_h
+#include "rascal.h"
+#include "object.h"
+
+/*
+
+Strings
+
+str-slice returns a string sharing the buffer of its argument, so cutting a string up
+costs nothing per character; the buffer lives as long as any slice of it. str-cat and
+strbuf->str copy. A strbuf collects strings, symbols and numbers with strbuf-append!
+and is turned into a string once at the end, so building a long string piece by piece
+is linear rather than quadratic.
+
+*/
+
+/* Forward declarations */
+uint64_t str_hash(lobj_t *);
+lobj_t * prim_str_len(lobj_t * args[1], lobj_t **);
+lobj_t * prim_str_ref(lobj_t * args[2], lobj_t **);
+lobj_t * prim_str_slice(lobj_t * args[3], lobj_t **);
+lobj_t * prim_str_cat(lobj_t * args[2], lobj_t **);
+lobj_t * prim_str_eq(lobj_t * args[2], lobj_t **);
+lobj_t * prim_str_hash(lobj_t * args[1], lobj_t **);
+lobj_t * prim_make_strbuf(lobj_t ** args, lobj_t **);
+lobj_t * prim_strbuf_append(lobj_t * args[2], lobj_t **);
+lobj_t * prim_strbuf_len(lobj_t * args[1], lobj_t **);
+lobj_t * prim_strbuf_to_str(lobj_t * args[1], lobj_t **);
+
+#endif
@@ -27,6 +27,17 @@ int list_len(lobj_t * xs) {
   return out;
 }
 
+// FNV-1a hash of len bytes
+uint64_t hash_mem(char * s, size_t len) {
+  uint64_t h = 14695981039346656037UL;
+
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211UL;
+  }
+
+  return h;
+}
 
 tuple_t * list_to_vector(lobj_t * xs) {
   int idx = list_len(xs);
@@ -40,26 +51,70 @@ tuple_t * list_to_vector(lobj_t * xs) {
   return out;
 }
 
-// Get a vector of arguments and check arity
-lobj_t ** getargs(lobj_t * fun, lobj_t * args) {
-  lobj_t ** out;
-  tuple_t * argstup = list_to_vector(args);
-  int len = argstup->len;
+// Raise an arity error unless fun accepts len arguments
+void check_arity(lobj_t * fun, int len) {
   int argc = isprim(fun) ? toprim(fun)->argc : toproc(fun)->argc;
   int vararg = isprim(fun) ? toprim(fun)->vararg : toproc(fun)->vararg;
 
-  if (vararg) {
-    if (((argstup->len) % (argc - 1)) != 1) {
-      del_tuple(argstup);
-      LRAISE("arity error: expected %d args to #, got %d", argc, len);
-    }
-  } else if (argc != len) {
-    del_tuple(argstup);
+  if (vararg ? (len % (argc - 1)) != 1 : argc != len) {
     LRAISE("arity error: expected %d args to #, got %d", argc, len);
   }
+}
 
-  out = argstup->values;
-  free(argstup);
 
-  return out;
+/*
+Pointer maps. Open addressing with linear probing, keyed by address; a missing key
+reads as 0. A pool worker uses one to remember which version of each of the caller's
+global bindings it last copied, copying between heaps one to find what has already been
+copied, and a heap image one to number the objects it writes.
+ */
+static size_t ptr_hash(void * p) {
+  return (size_t)((((uintptr_t)p >> 3) * 11400714819323198485UL) >> 32);
+}
+
+static void ptrmap_resize(ptrmap_t * m, size_t cap) {
+  void ** keys = m->keys;
+  unsigned * vals = m->vals;
+  size_t oldcap = m->cap, mask = cap - 1, j;
+
+  m->keys = calloc(cap, sizeof(void*));
+  m->vals = calloc(cap, sizeof(unsigned));
+  m->cap = cap;
+
+  for (size_t i = 0; i < oldcap; i++) {
+    if (keys[i] == NULL) continue;
+    for (j = ptr_hash(keys[i]) & mask; m->keys[j] != NULL; j = (j + 1) & mask);
+    m->keys[j] = keys[i];
+    m->vals[j] = vals[i];
   }
+
+  free(keys);
+  free(vals);
+}
+
+unsigned * ptrmap_slot(ptrmap_t * m, void * key) {
+  if (2 * (m->count + 1) > m->cap) ptrmap_resize(m, m->cap ? 2 * m->cap : 64);
+
+  size_t mask = m->cap - 1, i = ptr_hash(key) & mask;
+
+  for (; m->keys[i] != NULL; i = (i + 1) & mask) {
+    if (m->keys[i] == key) return &m->vals[i];
+  }
+
+  m->keys[i] = key;
+  m->vals[i] = 0;
+  m->count++;
+
+  return &m->vals[i];
+}
+
+void ptrmap_clear(ptrmap_t * m) {
+  if (m->cap > 0) memset(m->keys, 0, m->cap * sizeof(void*));
+  m->count = 0;
+}
+
+void ptrmap_free(ptrmap_t * m) {
+  free(m->keys);
+  free(m->vals);
+  *m = (ptrmap_t){ 0 };
+}
@@ -9,9 +9,21 @@ typedef struct _tuple_t {
   lobj_t ** values;
 } tuple_t;
 
+// Map from addresses to unsigned (see util.c)
+typedef struct _ptrmap_t {
+  void ** keys;
+  unsigned * vals;
+  size_t count;
+  size_t cap;
+} ptrmap_t;
+
 tuple_t * new_tuple(int);
 int list_len(lobj_t *);
+uint64_t hash_mem(char *, size_t);
 tuple_t * list_to_tuple(lobj_t *);
-lobj_t ** getargs(lobj_t *, lobj_t *);
+void check_arity(lobj_t *, int);
+unsigned * ptrmap_slot(ptrmap_t *, void *);
+void ptrmap_clear(ptrmap_t *);
+void ptrmap_free(ptrmap_t *);
 
 #endif
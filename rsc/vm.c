@@ -0,0 +1,563 @@
+#include "vm.h"
+#include "eval.h"
+#include "util.h"
+#include "alloc.h"
+
+/*
+Compiler. Translates a resolved lambda body (see resolve in eval.c) into bytecode.
+Special forms are recognised by their global binding when the lambda is compiled, in
+the same way resolve recognises them. Anything the compiler does not handle (macros,
+quoted data containing unquote, malformed forms) is compiled to OP_EVAL and left to
+lobj_eval.
+*/
+
+// Primitives with an opcode of their own, in opcode order from OP_ADD
+static const proc_t ARITH_PRIMS[] = { prim_add, prim_sub, prim_mul, prim_div, prim_mod, prim_eq };
+#define NARITH (int)(sizeof(ARITH_PRIMS) / sizeof(ARITH_PRIMS[0]))
+
+typedef struct _comp_t {
+  int32_t * instrs;
+  int len;
+  int cap;
+  lobj_t * consts;   // reversed; registered on the shadow stack
+  int nconsts;
+  int ncaches;
+  int nofold;        // set while compiling the unfolded fallback of a folded expression
+} comp_t;
+
+static void emit(comp_t * c, int32_t word) {
+  if (c->len == c->cap) {
+    c->cap *= 2;
+    c->instrs = realloc(c->instrs, c->cap * sizeof(int32_t));
+  }
+
+  c->instrs[c->len++] = word;
+}
+
+static int constant(comp_t * c, lobj_t * x) {
+  c->consts = new_cons(x, c->consts);
+  return c->nconsts++;
+}
+
+static void emit_const(comp_t * c, int op, lobj_t * x) {
+  int k = constant(c, x);
+  emit(c, op);
+  emit(c, k);
+}
+
+// A reference to a global carries the name and an inline cache slot
+static void emit_global(comp_t * c, int op, lobj_t * sym) {
+  emit_const(c, op, sym);
+  emit(c, c->ncaches++);
+}
+
+// Length of a proper list, or -1
+static int proper_len(lobj_t * xs) {
+  int n = 0;
+  for (; iscons(xs); xs = cdr(xs)) n++;
+  return isnil(xs) ? n : -1;
+}
+
+/*
+Constant folding. A call to one of FOLD_PRIMS whose arguments are all constant is
+evaluated when the lambda is compiled, as is the test of an if. The result depends on
+the globals the primitives (and nil and t) were found in, so the folded code is preceded
+by an OP_GUARD for each of them checking that its binding still has the version it had
+at compile time; if not, the guard jumps to the unfolded code compiled after it.
+Division by zero, negative powers and overflow are left to run (and fail) as written.
+*/
+
+// In the order of num_op's operations, prim_eq last
+static const proc_t FOLD_PRIMS[] = { prim_add, prim_sub, prim_mul, prim_div, prim_mod, prim_pow, prim_eq };
+#define NFOLD (int)(sizeof(FOLD_PRIMS) / sizeof(FOLD_PRIMS[0]))
+#define MAX_GUARDS 8
+
+typedef struct _fold_t {
+  int n;
+  lobj_t * syms[MAX_GUARDS];      // symbols are never moved by the collector
+  unsigned versions[MAX_GUARDS];
+  int sites[MAX_GUARDS];          // jump operands to patch with the fallback
+} fold_t;
+
+static int guard(fold_t * f, lobj_t * sym, gbind_t * b) {
+  for (int i = 0; i < f->n; i++) {
+    if (f->syms[i] == sym) return 1;
+  }
+
+  if (f->n == MAX_GUARDS) return 0;
+
+  f->syms[f->n] = sym;
+  f->versions[f->n++] = b->version;
+  return 1;
+}
+
+// If x always has the same value while the globals added to f keep their bindings,
+// store the value in *out (which must be registered on the shadow stack)
+static int fold(lobj_t * x, lobj_t ** out, fold_t * f) {
+  lobj_t * args[2] = { NIL, NIL }, * head;
+  gbind_t * b;
+  proc_t p = NULL;
+  int ok, k = 0;
+  long z;
+
+  if (issym(x)) {
+    b = global_ref(x);
+    if (b == NULL || !isconst(b->value) || !guard(f, x, b)) return 0;
+    *out = b->value;
+    return 1;
+  }
+
+  if (!iscons(x)) {
+    if (islref(x)) return 0;
+    *out = x;
+    return 1;
+  }
+
+  head = car(x);
+  b = issym(head) ? global_ref(head) : NULL;
+
+  if (head == CONSTANT || (b != NULL && isprim(b->value) && toprim(b->value)->body == form_quote)) {
+    if (proper_len(cdr(x)) != 1 || (head != CONSTANT && !quotable(car(cdr(x))))) return 0;
+    *out = car(cdr(x));
+    return 1;
+  }
+
+  for (int i = 0; b != NULL && isprim(b->value) && i < NFOLD; i++) {
+    if (toprim(b->value)->body == FOLD_PRIMS[i]) p = FOLD_PRIMS[k = i];
+  }
+
+  if (p == NULL || proper_len(cdr(x)) != 2 || !guard(f, head, b)) return 0;
+
+  preserve(&x, &args[0], &args[1]);
+  ok = fold(car(cdr(x)), &args[0], f) && fold(car(cdr(cdr(x))), &args[1], f);
+  ok = ok && (p == prim_eq || (isnum(args[0]) && isnum(args[1])));
+  ok = ok && !((p == prim_div || p == prim_mod) && tonum(args[1]) == 0);
+  ok = ok && !(p == prim_pow && tonum(args[1]) < 0);
+  ok = ok && (p == prim_eq || num_op(k, tonum(args[0]), tonum(args[1]), &z));
+  if (ok) *out = p(args, NULL);
+  release(3);
+
+  return ok;
+}
+
+static void emit_guards(comp_t * c, fold_t * f) {
+  for (int i = 0; i < f->n; i++) {
+    emit_global(c, OP_GUARD, f->syms[i]);
+    emit(c, f->versions[i]);
+    f->sites[i] = c->len;
+    emit(c, 0);
+  }
+}
+
+static void patch_guards(comp_t * c, fold_t * f) {
+  for (int i = 0; i < f->n; i++) c->instrs[f->sites[i]] = c->len;
+}
+
+static void compile_expr(comp_t *, lobj_t *, int);
+
+// Compile a foldable expression; returns 0 if x is not one
+static int compile_folded(comp_t * c, lobj_t * x, int tail) {
+  lobj_t * v = NIL;
+  fold_t f = { 0 };
+  int k, end = 0;
+
+  preserve(&x, &v);
+
+  if (!fold(x, &v, &f)) {
+    release(2);
+    return 0;
+  }
+
+  k = constant(c, v);
+  emit_guards(c, &f);
+  emit(c, OP_CONST);
+  emit(c, k);
+
+  if (tail) {
+    emit(c, OP_RETURN);
+  } else if (f.n > 0) {
+    emit(c, OP_JUMP);
+    end = c->len;
+    emit(c, 0);
+  }
+
+  if (f.n > 0) {
+    patch_guards(c, &f);
+    c->nofold++;
+    compile_expr(c, x, tail);
+    c->nofold--;
+    if (!tail) c->instrs[end] = c->len;
+  }
+
+  release(2);
+  return 1;
+}
+
+static void compile_call(comp_t * c, lobj_t * x, int argc, int tail) {
+  lobj_t * args = cdr(x);
+  preserve(&args);
+
+  compile_expr(c, car(x), 0);
+  emit(c, OP_PUSH);
+
+  for (; iscons(args); args = cdr(args)) {
+    compile_expr(c, car(args), 0);
+    emit(c, OP_PUSH);
+  }
+
+  release(1);
+  emit(c, tail ? OP_TAILCALL : OP_CALL);
+  emit(c, argc);
+}
+
+static void compile_branches(comp_t * c, lobj_t * x, int tail) {
+  preserve(&x);
+  compile_expr(c, car(cdr(x)), 0);
+  emit(c, OP_BRANCH_NIL);
+  int branch = c->len;
+  emit(c, 0);
+  compile_expr(c, car(cdr(cdr(x))), tail);
+  int jump = c->len + 1;
+  if (!tail) {
+    emit(c, OP_JUMP);
+    emit(c, 0);
+  }
+  c->instrs[branch] = c->len;
+  compile_expr(c, car(cdr(cdr(cdr(x)))), tail);
+  if (!tail) c->instrs[jump] = c->len;
+  release(1);
+}
+
+// An if whose test folds compiles only the branch it selects, ahead of the full if
+static void compile_if(comp_t * c, lobj_t * x, int tail) {
+  lobj_t * test = NIL;
+  fold_t f = { 0 };
+  int end = 0;
+
+  preserve(&x, &test);
+
+  if (c->nofold || !fold(car(cdr(x)), &test, &f)) {
+    compile_branches(c, x, tail);
+    release(2);
+    return;
+  }
+
+  emit_guards(c, &f);
+  compile_expr(c, isnil(test) ? car(cdr(cdr(cdr(x)))) : car(cdr(cdr(x))), tail);
+
+  if (f.n > 0) {
+    if (!tail) {
+      emit(c, OP_JUMP);
+      end = c->len;
+      emit(c, 0);
+    }
+    patch_guards(c, &f);
+    c->nofold++;
+    compile_branches(c, x, tail);
+    c->nofold--;
+    if (!tail) c->instrs[end] = c->len;
+  }
+
+  release(2);
+}
+
+// Compile a list; returns 0 if x is not a form the compiler handles
+static int compile_form(comp_t * c, lobj_t * x, int tail) {
+  lobj_t * head = car(x), * fun = issym(head) ? lookup(head, &TOPENV) : head;
+  int argc = proper_len(cdr(x)), ok = 1, arith = -1;
+  proc_t form = isprim(fun) ? toprim(fun)->body : NULL;
+
+  for (int i = 0; form != NULL && issym(head) && argc == 2 && i < NARITH; i++) {
+    if (form == ARITH_PRIMS[i]) arith = i;
+  }
+
+  preserve(&x);
+
+  if (argc < 0) {
+    ok = 0;
+  } else if (form == form_constant) {
+    if ((ok = argc == 1)) emit_const(c, OP_CONST, car(cdr(x)));
+  } else if (form == form_quote) {
+    if ((ok = argc == 1 && quotable(car(cdr(x))))) emit_const(c, OP_CONST, car(cdr(x)));
+  } else if (form == form_if) {
+    if ((ok = argc == 3)) {
+      compile_if(c, x, tail);
+      tail = 0;
+    }
+  } else if (form == form_do) {
+    if ((ok = argc == 1 && proper_len(car(cdr(x))) > 0)) {
+      lobj_t * body = car(cdr(x));
+      preserve(&body);
+      for (; iscons(cdr(body)); body = cdr(body)) compile_expr(c, car(body), 0);
+      compile_expr(c, car(body), tail);
+      release(1);
+      tail = 0;
+    } else if ((ok = argc == 1 && isnil(car(cdr(x))))) {
+      emit_const(c, OP_CONST, NIL);
+    }
+  } else if (form == form_def || form == form_setq) {
+    lobj_t * name = argc == 2 ? car(cdr(x)) : NIL;
+    if ((ok = issym(name) || (form == form_setq && islref(name)))) {
+      compile_expr(c, car(cdr(cdr(x))), 0);
+      name = car(cdr(x));
+      if (islref(name)) {
+        emit(c, OP_SETLOCAL);
+        emit(c, tolref(name)->depth);
+        emit(c, tolref(name)->slot);
+      } else {
+        emit_global(c, form == form_def ? OP_DEFGLOBAL : OP_SETGLOBAL, name);
+      }
+    }
+  } else if (form == form_closure) {
+    if ((ok = argc == 2)) {
+      lobj_t * proto = new_proc(car(cdr(x)), car(cdr(cdr(x))), NIL, 0, EVAL_PROC);
+      preserve(&proto);
+      compile_lambda(proto);
+      emit_const(c, OP_CLOSURE, proto);
+      release(1);
+    }
+  } else if ((form != NULL && toprim(fun)->evaltype != EVAL_PROC) ||
+             (isproc(fun) && toproc(fun)->evaltype != EVAL_PROC)) {
+    ok = 0;
+  } else if (arith >= 0) {
+    compile_expr(c, car(cdr(x)), 0);
+    emit(c, OP_PUSH);
+    compile_expr(c, car(cdr(cdr(x))), 0);
+    emit_global(c, OP_ADD + arith, car(x));
+  } else {
+    compile_call(c, x, argc, tail);
+    tail = 0;
+  }
+
+  release(1);
+  if (ok && tail) emit(c, OP_RETURN);
+  return ok;
+}
+
+// Compile x, leaving its value in ACCUM. In tail position the code also returns.
+static void compile_expr(comp_t * c, lobj_t * x, int tail) {
+  preserve(&x);
+
+  switch (lobj_type(x)) {
+  case LOBJ_SYM:
+    emit_global(c, OP_GLOBAL, x);
+    break;
+  case LOBJ_LREF:
+    emit(c, OP_LOCAL);
+    emit(c, tolref(x)->depth);
+    emit(c, tolref(x)->slot);
+    break;
+  case LOBJ_CONS:
+    if ((!c->nofold && compile_folded(c, x, tail)) || compile_form(c, x, tail)) {
+      release(1);
+      return;
+    }
+    emit_const(c, OP_EVAL, x);
+    break;
+  default:
+    emit_const(c, OP_CONST, x);
+  }
+
+  release(1);
+  if (tail) emit(c, OP_RETURN);
+}
+
+// Compile the body of fun and store the code in it
+lobj_t * compile_lambda(lobj_t * fun) {
+  comp_t c = { malloc(64 * sizeof(int32_t)), 0, 64, NIL, 0, 0, 0 };
+  lobj_t * code;
+
+  preserve(&fun, &c.consts);
+  compile_expr(&c, toproc(fun)->body, 1);
+  code = LOBJ_CAST(mk_code(c.instrs, c.len, c.consts, c.nconsts, c.ncaches));
+  write_barrier(fun, code);
+  toproc(fun)->code = code;
+  release(2);
+
+  return code;
+}
+
+/*
+Interpreter. vm_run executes CODE from pc until a return brings SP back down to stop.
+A call to a compiled lambda stays in the same loop; only primitives, OP_EVAL and
+rebound arithmetic re-enter C, so tail calls between lambdas run in constant C stack.
+*/
+
+// Enter the lambda under the top argc values. If ret is not negative, the caller's
+// registers are saved with ret as the return address.
+static void vm_enter(int argc, long ret) {
+  lobj_t * frame, * code;
+
+  if (!iscode(toproc(STACK[SP - argc - 1])->code)) compile_lambda(STACK[SP - argc - 1]);
+
+  LASSERT(argc == toproc(STACK[SP - argc - 1])->argc, "arity error")
+  frame = new_frame(toproc(STACK[SP - argc - 1])->env, argc);
+  // Code objects are old, so this pointer is not moved by a collection
+  code = toproc(STACK[SP - argc - 1])->code;
+  memcpy(toframe(frame)->slots, &STACK[SP - argc], argc * sizeof(lobj_t*));
+  SP -= argc + 1;
+
+  if (ret >= 0) {
+    LASSERT(SP + 3 <= STACKSIZE, "stack overflow")
+    STACK[SP++] = ENV;
+    STACK[SP++] = CODE;
+    STACK[SP++] = fixnum(ret);
+  }
+
+  CODE = code;
+  ENV = frame;
+}
+
+// The binding of the global name, looked up the first time the site runs after it exists
+static inline gbind_t * cached_binding(icache_t * ic, lobj_t * name) {
+  if (ic->binding == NULL) ic->binding = global_ref(name);
+  return ic->binding;
+}
+
+static lobj_t * vm_run(size_t stop) {
+  // The registers are reached through one load of the thread's context
+  rascal_ctx * const ctx = RASCAL;
+#define RASCAL ctx
+  int32_t * pc = tocode(CODE)->instrs;
+  int op, argc;
+
+#define K(i)  (tocode(CODE)->consts[i])
+#define AT(i) (tocode(CODE)->instrs + (i))
+#define IC(i) (&tocode(CODE)->caches[i])
+
+  while (1) {
+    switch (op = *pc++) {
+    case OP_CONST:
+      ACCUM = K(*pc++);
+      break;
+    case OP_LOCAL:
+      ACCUM = *frame_slot(ENV, pc[0], pc[1]);
+      pc += 2;
+      break;
+    case OP_SETLOCAL:{
+      lobj_t * frame = ENV;
+      for (int i = 0; i < pc[0]; i++) frame = toframe(frame)->parent;
+      write_barrier(frame, ACCUM);
+      toframe(frame)->slots[pc[1]] = ACCUM;
+      pc += 2;
+      break;
+    }case OP_GLOBAL:{
+      gbind_t * b = cached_binding(IC(pc[1]), K(pc[0]));
+      ACCUM = b == NULL ? UNBOUND : b->value;
+      pc += 2;
+      break;
+    }case OP_SETGLOBAL:{
+      gbind_t * b = cached_binding(IC(pc[1]), K(pc[0]));
+      if (b != NULL) global_set(b, ACCUM);
+      pc += 2;
+      break;
+    }case OP_DEFGLOBAL:{
+      icache_t * ic = IC(pc[1]);
+      if (ic->binding == NULL) ic->binding = global_def(K(pc[0]), ACCUM);
+      else global_set(ic->binding, ACCUM);
+      pc += 2;
+      break;
+    }
+    case OP_PUSH:
+      push(ACCUM);
+      break;
+    case OP_GUARD:{
+      gbind_t * b = cached_binding(IC(pc[1]), K(pc[0]));
+      pc = b != NULL && b->version == (unsigned)pc[2] ? pc + 4 : AT(pc[3]);
+      break;
+    }
+    case OP_JUMP:
+      pc = AT(*pc);
+      break;
+    case OP_BRANCH_NIL:
+      pc = isnil(ACCUM) ? AT(*pc) : pc + 1;
+      break;
+    case OP_CLOSURE:{
+      lobj_t * proto = K(*pc++);
+      ACCUM = new_proc(toproc(proto)->formals, toproc(proto)->body, ENV, 0, EVAL_PROC);
+      proto = K(pc[-1]);
+      write_barrier(ACCUM, toproc(proto)->code);
+      toproc(ACCUM)->code = toproc(proto)->code;
+      break;
+    }case OP_EVAL:
+      ACCUM = lobj_eval(K(*pc++), &ENV);
+      break;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_EQ:{
+      icache_t * ic = IC(pc[1]);
+      gbind_t * b = cached_binding(ic, K(pc[0]));
+      lobj_t * fun = b == NULL ? UNBOUND : b->value;
+      pc += 2;
+
+      // The check that the global still holds the primitive is redone only after a store
+      if (b != NULL && ic->version != b->version) {
+        ic->version = isprim(fun) && toprim(fun)->body == ARITH_PRIMS[op - OP_ADD] ? b->version : 0;
+      }
+
+      if (b != NULL && ic->version == b->version) {
+        lobj_t * x = STACK[--SP];
+        ACCUM = op == OP_EQ ? lobj_eq(x, ACCUM) : new_num(num_arith(op - OP_ADD, tonum(x), tonum(ACCUM)));
+        break;
+      }
+
+      // The global has been rebound: call its new value with the same arguments
+      push(ACCUM);
+      push(ACCUM);
+      STACK[SP - 2] = STACK[SP - 3];
+      STACK[SP - 3] = fun;
+      argc = 2;
+      goto call;
+    }
+    case OP_CALL:
+    case OP_TAILCALL:{
+      argc = *pc++;
+    call:;
+      lobj_t * fun = STACK[SP - argc - 1];
+
+      if (isproc(fun)) {
+        vm_enter(argc, op == OP_TAILCALL ? -1 : pc - tocode(CODE)->instrs);
+        pc = tocode(CODE)->instrs;
+        break;
+      }
+
+      if (isprim(fun)) {
+        check_arity(fun, argc);
+        ACCUM = toprim(fun)->body(&STACK[SP - argc], &ENV);
+      } else {
+        // Not a function: the value is the list of the values, as in lobj_eval
+        ACCUM = NIL;
+        for (int i = 0; i <= argc; i++) ACCUM = new_cons(STACK[SP - 1 - i], ACCUM);
+      }
+
+      SP -= argc + 1;
+      if (op != OP_TAILCALL) break;
+    }// fall through
+    case OP_RETURN:
+      if (SP == stop) return ACCUM;
+      SP -= 3;
+      ENV = STACK[SP];
+      CODE = STACK[SP + 1];
+      pc = AT(fixnum_val(STACK[SP + 2]));
+      break;
+    }
+  }
+
+#undef K
+#undef AT
+#undef IC
+#undef RASCAL
+}
+
+// Call the lambda under the top argc values from C. The caller's registers are saved
+// as for a non-tail call, and the return to them ends the loop.
+lobj_t * vm_call(int argc) {
+  size_t base = SP - argc - 1;
+
+  vm_enter(argc, 0);
+  ACCUM = vm_run(base + 3);
+
+  SP = base;
+  ENV = STACK[base];
+  CODE = STACK[base + 1];
+
+  return ACCUM;
+}
@@ -4,12 +4,58 @@
 #include "rascal.h"
 #include "object.h"
 
+/*
+
+Bytecode VM
+
+Instructions are 32-bit words: an opcode followed by its operands. Values are
+computed into ACCUM; arguments are pushed on STACK. A call leaves the callee
+and its arguments on the stack; a non-tail call saves ENV, CODE and the return
+address above them before entering the callee. STACK, ACCUM, ENV and CODE are
+roots of the collector.
+
+Each reference to a global has an inline cache slot (c) in its code object
+holding the binding, so the name is hashed only the first time the site runs.
+
+*/
+
+enum {
+  OP_CONST,        // k          ACCUM = consts[k]
+  OP_LOCAL,        // depth slot ACCUM = local
+  OP_SETLOCAL,     // depth slot local = ACCUM
+  OP_GLOBAL,       // k c        ACCUM = value of global consts[k]
+  OP_SETGLOBAL,    // k c        update global consts[k] (if bound) with ACCUM
+  OP_DEFGLOBAL,    // k c        bind global consts[k] to ACCUM
+  OP_PUSH,         //            push ACCUM
+  OP_CALL,         // argc       call the function below the top argc values
+  OP_TAILCALL,     // argc       as OP_CALL, reusing the caller's return address
+  OP_RETURN,
+  OP_JUMP,         // offset
+  OP_BRANCH_NIL,   // offset     jump if ACCUM is nil
+  OP_CLOSURE,      // k          close the lambda consts[k] over ENV
+  OP_EVAL,         // k          ACCUM = lobj_eval(consts[k]) in ENV
+  OP_GUARD,        // k c v off  jump unless global consts[k] has version v
+  // Arithmetic on the popped value and ACCUM. The operands are the global the
+  // primitive was found in and its cache; if it has been rebound the call is made normally.
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_EQ,
+};
+
 #define STACKSIZE 2048 * 2048
-// Argument registers
-int64_t ACCUM;
+// Value register
+#define ACCUM (RASCAL->accum)
 // Register for the current environment
-lobj_t * ENV;
+#define ENV   (RASCAL->env)
+// Code object being run
+#define CODE  (RASCAL->code)
+
+#define STACK (RASCAL->stack)
+#define SP    (RASCAL->sp)
+
+// v must not allocate: the slot is claimed before it is evaluated
+#define push(v) ({ LASSERT(SP < STACKSIZE, "stack overflow") STACK[SP++] = (v); })
 
-lobj_t * STACK[STACKSIZE];
+/* Forward declarations */
+lobj_t * compile_lambda(lobj_t *);
+lobj_t * vm_call(int);
 
 #endif